@@ -11,11 +11,247 @@
  * The tags are stored at the top of memory.
  */
 
+#include <stddef.h>
+#include <string.h>
+
+/* Conservative stack scanning needs the object start bitmap. */
+#if defined(IBGC_CONSERVATIVE) && !defined(IBGC_INTERIOR)
+#define IBGC_INTERIOR
+#endif
+
+#if defined(IBGC_IMMIX) && defined(IBGC_COMPACT)
+#error "IBGC_IMMIX and IBGC_COMPACT cannot be combined"
+#endif
+
+/* The nursery promotes into the free list heap, and moves objects,
+ * which conservative stack scanning does not allow. */
+#if defined(IBGC_NURSERY) && (defined(IBGC_IMMIX) || defined(IBGC_CONSERVATIVE))
+#error "IBGC_NURSERY cannot be combined with IBGC_IMMIX or IBGC_CONSERVATIVE"
+#endif
+
+/* Allocation buffers are carved from the free list, and the nursery
+ * is shared. Threads need the GCC atomic builtins. */
+#ifdef IBGC_THREADS
+#if defined(IBGC_IMMIX) || defined(IBGC_NURSERY)
+#error "IBGC_THREADS cannot be combined with IBGC_IMMIX or IBGC_NURSERY"
+#endif
+#ifndef __GNUC__
+#error "IBGC_THREADS requires GCC or a compatible compiler"
+#endif
+#include <pthread.h>
+#include <time.h>
+#endif
+
+/* Counts are kept by address, for objects that stay in place, and
+ * only the registered roots are checked before freeing. */
+#if defined(IBGC_REFCOUNT) && (defined(IBGC_IMMIX) || \
+    defined(IBGC_NURSERY) || defined(IBGC_CONSERVATIVE) || defined(IBGC_THREADS))
+#error "IBGC_REFCOUNT cannot be combined with IBGC_IMMIX, IBGC_NURSERY, IBGC_CONSERVATIVE or IBGC_THREADS"
+#endif
+
+/* The treadmill replaces the free list with lists of fixed-size slots,
+ * which objects never leave. */
+#if defined(IBGC_TREADMILL) && (defined(IBGC_IMMIX) || \
+    defined(IBGC_COMPACT) || defined(IBGC_NURSERY) || \
+    defined(IBGC_INTERIOR) || defined(IBGC_THREADS) || \
+    defined(IBGC_REFCOUNT) || defined(IBGC_REGIONS) || defined(IBGC_IMAGE))
+#error "IBGC_TREADMILL cannot be combined with IBGC_IMMIX, IBGC_COMPACT, IBGC_NURSERY, IBGC_INTERIOR, IBGC_CONSERVATIVE, IBGC_THREADS, IBGC_REFCOUNT, IBGC_REGIONS or IBGC_IMAGE"
+#endif
+
+/* Checking for references that escape regions needs regions. */
+#if defined(IBGC_REGION_CHECK) && !defined(IBGC_REGIONS)
+#define IBGC_REGIONS
+#endif
+
+/* Regions are taken from the free list. */
+#if defined(IBGC_REGIONS) && defined(IBGC_IMMIX)
+#error "IBGC_REGIONS cannot be combined with IBGC_IMMIX"
+#endif
+
+/* The lock-free shared span is taken from the free list under
+ * heap_lock. */
+#if defined(IBGC_LOCKFREE) && !defined(IBGC_THREADS)
+#error "IBGC_LOCKFREE requires IBGC_THREADS"
+#endif
+
+/* The sweep walks the free list heap between collections, while the
+ * program allocates. It does not rebuild reference counts, allocation
+ * buffers or the nursery's remembered set. */
+#if defined(IBGC_INCREMENTAL_SWEEP) && (defined(IBGC_IMMIX) || \
+    defined(IBGC_TREADMILL) || defined(IBGC_NURSERY) || \
+    defined(IBGC_THREADS) || defined(IBGC_REFCOUNT))
+#error "IBGC_INCREMENTAL_SWEEP cannot be combined with IBGC_IMMIX, IBGC_TREADMILL, IBGC_NURSERY, IBGC_THREADS or IBGC_REFCOUNT"
+#endif
+#ifdef IBGC_INCREMENTAL_SWEEP
+#include <time.h>
+#endif
+
+#ifdef IBGC_CONSERVATIVE
+#include <setjmp.h>
+#endif
+
+#ifdef IBGC_IMAGE
+#include <stdio.h>
+#if defined(__unix__) || defined(__APPLE__)
+#define IMAGE_MMAP
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+#endif
+
+/* The size of memory. Heap images can be loaded into builds with a
+ * larger MEM_BYTES. */
+#ifndef MEM_BYTES
 #define MEM_BYTES 0xc000
+#endif
 #define TAG_BASE ((MEM_BYTES >> 2) * 3)
+#if defined(IBGC_LOCKFREE) && MEM_BYTES > 0x10000
+#error "IBGC_LOCKFREE packs addresses into 16 bits"
+#endif
 #define ALLOC_BASE 0x0400
 
-/* Tags consist of four bits: mpci.
+/* Number of slots on the shadow stack and in the root table. */
+#ifndef SHADOW_STACK_SIZE
+#define SHADOW_STACK_SIZE 256
+#endif
+#ifndef ROOT_TABLE_SIZE
+#define ROOT_TABLE_SIZE 64
+#endif
+
+/* Number of objects that can be registered for finalization, and
+ * queued for finalization at once. */
+#ifndef FINAL_TABLE_SIZE
+#define FINAL_TABLE_SIZE 64
+#endif
+#ifndef FINAL_QUEUE_SIZE
+#define FINAL_QUEUE_SIZE 64
+#endif
+
+/* The fragmentation index (see gc_fragmentation()) above which
+ * gc_collect() compacts the heap, when compiled with IBGC_COMPACT. */
+#ifndef COMPACT_THRESHOLD
+#define COMPACT_THRESHOLD 50
+#endif
+
+/* Line and block sizes for IBGC_IMMIX, and the number of marked lines
+ * at or below which the objects in a block are evacuated. A block's
+ * lines must fit in an unsigned long. */
+#define LINE_BYTES 32
+#define BLOCK_LINES 32
+#ifndef EVACUATE_LINES
+#define EVACUATE_LINES (BLOCK_LINES / 4)
+#endif
+
+/* Size of the nursery, at the top of memory below the tags, and the
+ * number of objects the remembered set can hold, for IBGC_NURSERY. */
+#ifndef NURSERY_BYTES
+#define NURSERY_BYTES 0x1000
+#endif
+#define NURSERY_BASE (TAG_BASE - NURSERY_BYTES)
+#ifndef REMEMBERED_SIZE
+#define REMEMBERED_SIZE 64
+#endif
+
+/* The number of objects the zero count table of IBGC_REFCOUNT holds. */
+#ifndef ZCT_SIZE
+#define ZCT_SIZE 64
+#endif
+
+/* Heap images start memory at a multiple of IMAGE_ALIGN bytes into
+ * the file, after the collector state, so that it can be mapped with
+ * IBGC_IMAGE. This must be a multiple of the page size, and divide
+ * MEM_BYTES. */
+#ifndef IMAGE_ALIGN
+#define IMAGE_ALIGN 0x4000
+#endif
+
+/* The number of threads that can be attached with IBGC_THREADS, and
+ * the number of cells in a thread-local allocation buffer. */
+#ifndef MAX_THREADS
+#define MAX_THREADS 16
+#endif
+#ifndef TLAB_CELLS
+#define TLAB_CELLS 64
+#endif
+
+/* The number of regions that can be open at once with IBGC_REGIONS. */
+#ifndef MAX_REGIONS
+#define MAX_REGIONS 16
+#endif
+
+/* For IBGC_TREADMILL: the number of size classes, which hold objects
+ * of up to 1, 2, 4, ... cells, the size of the pages that are divided
+ * into slots of one class, the number of cells the collector scans per
+ * allocation while a cycle is in progress, and the percentage of the
+ * slots of a class below which allocating from it starts a cycle, once
+ * fewer than TREADMILL_CLASSES pages are unused. The largest slot, plus
+ * a cell, must fit in a page. */
+#ifndef TREADMILL_CLASSES
+#define TREADMILL_CLASSES 8
+#endif
+#ifndef TREADMILL_PAGE
+#define TREADMILL_PAGE 0x400
+#endif
+#ifndef TREADMILL_QUANTUM
+#define TREADMILL_QUANTUM 32
+#endif
+#ifndef TREADMILL_THRESHOLD
+#define TREADMILL_THRESHOLD 25
+#endif
+
+/* The number of cells gc_sweep() sweeps between checks of the clock,
+ * when it is given a time budget, with IBGC_INCREMENTAL_SWEEP. */
+#ifndef SWEEP_CHUNK
+#define SWEEP_CHUNK 256
+#endif
+
+/* How many roots ahead gc_trace_roots() prefetches tags. */
+#define PREFETCH_AHEAD 8
+
+#ifdef __GNUC__
+#define PREFETCH(P) __builtin_prefetch(P)
+#define NOINLINE __attribute__((noinline))
+#else
+#define PREFETCH(P) ((void) 0)
+#define NOINLINE
+#endif
+
+/* The conservative stack scan reads the frames of other functions,
+ * which AddressSanitizer would report. */
+#ifdef __has_attribute
+#if __has_attribute(no_sanitize_address)
+#define NO_SANITIZE_ADDRESS __attribute__((no_sanitize_address))
+#endif
+#endif
+#ifndef NO_SANITIZE_ADDRESS
+#define NO_SANITIZE_ADDRESS
+#endif
+
+/* With IBGC_THREADS, threads allocating from their own buffers may
+ * update the same word of a bitmap at once. */
+#ifdef IBGC_THREADS
+#define SETBITS(W, B) __atomic_fetch_or(&(W), (B), __ATOMIC_RELAXED)
+#define CLEARBITS(W, B) __atomic_fetch_and(&(W), ~(B), __ATOMIC_RELAXED)
+#else
+#define SETBITS(W, B) ((W) |= (B))
+#define CLEARBITS(W, B) ((W) &= ~(B))
+#endif
+
+/* Tags consist of seven bits: wkkmpci.
+ *
+ * w is the weak bit. A cell with the weak bit set (and the pointer bit
+ * clear) holds a weak reference: the tracer does not follow it, and if
+ * the object it points to is found to be unreachable, the cell is set
+ * to ADDR_MASK. Weak references must point to the first cell of an
+ * object.
+ *
+ * kk is the kind of the object the cell belongs to, and is the same
+ * for all cells of an object. It is set when the object is allocated.
+ * Objects of kind KIND_PTRS hold a pointer in every cell, except for
+ * cells that hold ADDR_MASK. Objects of kind KIND_RAW do not hold any
+ * pointers. Objects of kind KIND_EPHEMERON are ephemerons, see below.
+ * For these kinds, the p bit is ignored, so the program does not have
+ * to maintain it. For ordinary objects, kk is 0.
  *
  * m is the mark bit, used to indicate if an object has been marked as
  * reachable. The memory manager only uses this bit for the first cell
@@ -29,34 +265,287 @@
  *
  * i is an info bit. It is not used by the memory manager, but can be used
  * by the program to store a bit of information about a cell.
+ *
+ * In addition, the memory manager uses the top bit of the tag as
+ * scratch space while it is tracing, with IBGC_IMMIX, to mark objects
+ * that have been moved while it evacuates them, and with
+ * IBGC_TREADMILL, to mark objects waiting to be scanned. It is always
+ * 0 otherwise.
  */
-enum { INFO_MASK = 1, CONT_MASK = 2, PTR_MASK = 4, MARK_MASK = 8 };
+enum { INFO_MASK = 1, CONT_MASK = 2, PTR_MASK = 4, MARK_MASK = 8,
+       KIND_MASK = 0x30, WEAK_MASK = 0x40, SCRATCH_MASK = 0x80 };
+enum { KIND_PTRS = 0x10, KIND_RAW = 0x20, KIND_EPHEMERON = 0x30 };
 
+/* An ephemeron consists of EPHEMERON_CELLS cells: a key, a value and
+ * a link used by the collector. The value is only traced if the key
+ * is reachable through some other path. If the key is unreachable,
+ * both key and value are set to ADDR_MASK. */
+enum { EPHEMERON_CELLS = 3 };
+#define EPHEMERON_LINK(P) M((P) + 2 * CELL_SZ)
+
+/* The tag bits that describe the contents of an individual cell. */
+#define CELL_BITS (WEAK_MASK | PTR_MASK | INFO_MASK)
+
+/* A tag byte repeated in every byte of an unsigned long. */
+#define TAGWORD(T) ((unsigned long) -1 / 0xff * (T))
+
+#if defined(IBGC_IMAGE) && defined(__GNUC__)
+char mem[MEM_BYTES] __attribute__((aligned(IMAGE_ALIGN)));
+#else
 char mem[MEM_BYTES];
+#endif
 
 #define M(P) (*((cell_t*) (mem + (P))))
 
-uint8_t mark_tag = 0;
-addr_t alloc_top = TAG_BASE, freeptr = ALLOC_BASE;
+#define LONG_BITS (sizeof(long) * 8)
+
+#ifdef IBGC_INTERIOR
+/* Interior pointers. When IBGC_INTERIOR is defined, pointers may point
+ * at any cell of an object, not just the first one. To find the start
+ * of an object, the memory manager keeps a bitmap with one bit per
+ * cell, which is set for cells that are the first cell of an object.
+ */
+
+unsigned long objstarts[MEM_BYTES / CELL_SZ / LONG_BITS + 1];
+#endif
+
+#ifdef IBGC_IMMIX
+/* Mark-region heap. When IBGC_IMMIX is defined, memory is divided into
+ * lines of LINE_BYTES bytes, which are grouped into blocks of
+ * BLOCK_LINES lines. Each block has a word in lineused, with a bit for
+ * every line that is in use, and a word in linemarks, in which the
+ * tracer sets the bits for the lines of the objects it marks. Objects
+ * are allocated by bumping a pointer through holes: runs of unused
+ * lines. There is no free list.
+ */
+#define NBLOCKS (MEM_BYTES / LINE_BYTES / BLOCK_LINES + 1)
+
+unsigned long lineused[NBLOCKS], linemarks[NBLOCKS];
+#endif
+
+/* Collector phases. Between gc_begin() and gc_finish(), the collector
+ * is marking, and newly allocated objects are allocated black (already
+ * marked), so that they survive the cycle without having to be traced.
+ */
+enum { GC_IDLE, GC_MARKING };
+
+uint8_t mark_tag = 0, gc_phase = GC_IDLE;
+
+/* Set by gc_collect(), which knows all the roots, while it finishes a
+ * cycle. Objects may only be moved while it is set. */
+static int canmove = 0;
+#ifdef IBGC_NURSERY
+#define HEAP_TOP NURSERY_BASE
+#else
+#define HEAP_TOP TAG_BASE
+#endif
+addr_t alloc_top = HEAP_TOP, freeptr = ALLOC_BASE;
 
 static addr_t tagaddr(addr_t p) { return (p >> 2) + TAG_BASE; }
 static uint8_t gettag(addr_t p) { return mem[tagaddr(p)]; }
 static void settag(addr_t p, uint8_t t) { mem[tagaddr(p)] = t; }
 static void mark(addr_t p) { settag(p, (gettag(p) & ~MARK_MASK) | mark_tag); }
-static void unmark(addr_t p) { settag(p, (gettag(p) | MARK_MASK) ^ mark_tag); }
 static int isfree(addr_t p) { return (gettag(p) & MARK_MASK) != mark_tag; }
 static int hascont(addr_t p) { return (gettag(p) & CONT_MASK) != 0; }
+#if !defined(IBGC_IMMIX) && !defined(IBGC_TREADMILL)
+static void unmark(addr_t p) { settag(p, (gettag(p) | MARK_MASK) ^ mark_tag); }
 static addr_t nextfree(addr_t p) { return M(p); }
 static addr_t freelen(addr_t p) { return hascont(p) ? M(p + CELL_SZ) : 1; }
+#endif
+static uint8_t kind(addr_t p) { return gettag(p) & KIND_MASK; }
 
-/**
- * Allocates ncells cells of memory and tags them with the given tag.
- *
- * @return the address of the first cell, or ADDR_MASK if allocation
- *   failed (no large enough contiguous span of free cells was found).
+/* Returns the mark bit for new objects: marked during a collection
+ * cycle, unmarked otherwise. */
+static uint8_t newmark() {
+  return gc_phase == GC_IDLE ? mark_tag ^ MARK_MASK : mark_tag;
+}
+
+/* Returns nonzero if the cell at p holds a pointer to be traced. */
+static int isptr(addr_t p) {
+  switch (kind(p)) {
+  case 0: return gettag(p) & PTR_MASK;
+  case KIND_PTRS: return (addr_t) M(p) != ADDR_MASK;
+  default: return 0;
+  }
+}
+
+#ifdef IBGC_INTERIOR
+static void setstart(addr_t p) {
+  SETBITS(objstarts[p / CELL_SZ / LONG_BITS], 1UL << (p / CELL_SZ % LONG_BITS));
+}
+
+/* Clears the object start bits for the cells from p up to end. */
+static void clearstarts(addr_t p, addr_t end) {
+  size_t i = p / CELL_SZ, j = end / CELL_SZ;
+
+  for (; i != j && i % LONG_BITS; ++i) {
+    CLEARBITS(objstarts[i / LONG_BITS], 1UL << (i % LONG_BITS));
+  }
+  for (; j - i >= LONG_BITS; i += LONG_BITS) objstarts[i / LONG_BITS] = 0;
+  for (; i != j; ++i) CLEARBITS(objstarts[i / LONG_BITS], 1UL << (i % LONG_BITS));
+}
+
+/* Returns the index of the highest set bit in w, which is not 0. */
+static unsigned highbit(unsigned long w) {
+#ifdef __GNUC__
+  return LONG_BITS - 1 - __builtin_clzl(w);
+#else
+  unsigned n = 0;
+  for (; w >>= 1; ++n);
+  return n;
+#endif
+}
+
+/* Returns nonzero if p is the first cell of an object. */
+static int isstart(addr_t p) {
+  return (objstarts[p / CELL_SZ / LONG_BITS] >> (p / CELL_SZ % LONG_BITS)) & 1;
+}
+
+/*
+ * Returns the address of the first cell of the object p is part of.
+ * The object start bitmap is searched backwards a word at a time.
+ * If there is no object at or before p, returns ALLOC_BASE.
  */
-static addr_t alloc(addr_t ncells, uint8_t tag) {
-  addr_t len, p, next, prev = ADDR_MASK;
+static addr_t objstart(addr_t p) {
+  size_t i = p / CELL_SZ;
+  unsigned long w = objstarts[i / LONG_BITS] & ((2UL << (i % LONG_BITS)) - 1);
+
+  for (i /= LONG_BITS; w == 0; w = objstarts[--i]) {
+    if (i <= ALLOC_BASE / CELL_SZ / LONG_BITS) return ALLOC_BASE;
+  }
+  return (i * LONG_BITS + highbit(w)) * CELL_SZ;
+}
+#else
+static void setstart(addr_t p) {}
+#ifndef IBGC_TREADMILL
+static void clearstarts(addr_t p, addr_t end) {}
+#endif
+
+/* Returns the address of the first cell of the object p is part of. */
+static addr_t objstart(addr_t p) {
+  for (; gettag(p - CELL_SZ) & CONT_MASK; p -= CELL_SZ);
+  return p;
+}
+#endif
+
+/*
+ * Tags the cells from p up to end as the tail of an object of the given
+ * kind. The tags of consecutive cells are consecutive bytes, so all but
+ * the last can be filled in one go.
+ */
+static void conttags(addr_t p, addr_t end, uint8_t kind) {
+  end -= CELL_SZ;
+  memset(mem + tagaddr(p), CONT_MASK | kind, tagaddr(end) - tagaddr(p));
+  settag(end, kind);
+}
+
+#if !defined(IBGC_IMMIX) && !defined(IBGC_TREADMILL)
+/*
+ * The state of the sweep that returns unreachable objects to the free
+ * list. The cells below p have been swept, and the free spans among
+ * them are on the free list, the last one being prev_free. next_free
+ * is the first span at or after p of the free list from before the
+ * sweep, which is not on the free list. dead is the mark bit of
+ * unreachable objects. With IBGC_INCREMENTAL_SWEEP, the sweep goes on
+ * after gc_finish() has flipped the meaning of the mark bit, and p is
+ * ADDR_MASK when it is done.
+ */
+static struct {
+  addr_t p, next_free, prev_free;
+  uint8_t dead;
+} sweep = { ADDR_MASK, ADDR_MASK, ADDR_MASK, 0 };
+
+#ifdef IBGC_INCREMENTAL_SWEEP
+static int sweepcells(size_t n, addr_t want);
+#endif
+
+/* Makes p the first cell of a free span of len cells followed by next. */
+static void mkspan(addr_t p, addr_t next, addr_t len) {
+  M(p) = next;
+#ifdef IBGC_INCREMENTAL_SWEEP
+  /* The cells holding next and len must not look like weak
+   * references to clearweakrefs(). */
+  settag(p, gettag(p) & ~WEAK_MASK);
+  if (len > 1) settag(p + CELL_SZ, gettag(p + CELL_SZ) & ~WEAK_MASK);
+  if (next == ADDR_MASK) sweep.prev_free = p;
+#endif
+  if (len > 1) {
+    settag(p, gettag(p) | CONT_MASK);
+    M(p + CELL_SZ) = len;
+  } else {
+    settag(p, gettag(p) & ~CONT_MASK);
+  }
+}
+
+/*
+ * Clears the continuation bit of the cell before end. Cells cut from
+ * the middle of free memory, like the rest of an allocation buffer,
+ * may still have it from an object that was there before, which would
+ * make the object after them seem to start earlier.
+ */
+static void cutcells(addr_t end) {
+  settag(end - CELL_SZ, gettag(end - CELL_SZ) & ~CONT_MASK);
+}
+
+/*
+ * Puts the cells from p up to end on the free list, coalescing them
+ * with the free spans directly before and after them, if any.
+ */
+static void freespan(addr_t p, addr_t end) {
+  addr_t prev = ADDR_MASK, next = freeptr, len = (end - p) / CELL_SZ;
+
+#ifdef IBGC_INCREMENTAL_SWEEP
+  /* Cells the sweep has not reached yet are left for it to free, as
+   * an unreachable object. Objects do not straddle its cursor. */
+  if (p >= sweep.p) {
+    settag(p, KIND_RAW | (len > 1 ? CONT_MASK : 0) | sweep.dead);
+    if (len > 1) conttags(p + CELL_SZ, end, KIND_RAW);
+    return;
+  }
+#endif
+  clearstarts(p, end);
+  cutcells(end);
+
+  /* The free list is kept in address order. Find where p goes. */
+  for (; next < p; next = nextfree(next) & ADDR_MASK) prev = next;
+
+  if (next == end) {
+    len += freelen(next);
+    next = nextfree(next);
+  }
+  if (prev != ADDR_MASK && prev + freelen(prev) * CELL_SZ == p) {
+    mkspan(prev, next, freelen(prev) + len);
+  } else {
+    mkspan(p, next, len);
+    if (prev == ADDR_MASK) freeptr = p;
+    else M(prev) = p;
+  }
+}
+
+/*
+ * Removes the first ncells cells from the free span of len cells at p.
+ * prev is the free span before p, or ADDR_MASK if p is the first one.
+ */
+static void takespan(addr_t prev, addr_t p, addr_t len, addr_t ncells) {
+  addr_t next = nextfree(p);
+
+  if (len > ncells) {
+    mkspan(p + ncells * CELL_SZ, next, len - ncells);
+    next = p + ncells * CELL_SZ;
+  }
+#ifdef IBGC_INCREMENTAL_SWEEP
+  else if (next == ADDR_MASK) sweep.prev_free = prev;
+#endif
+  if (prev == ADDR_MASK) freeptr = next;
+  else M(prev) = next;
+}
+
+/*
+ * Takes ncells cells from the first free span that is large enough.
+ * Returns their address, or ADDR_MASK if there is no such span.
+ */
+static addr_t takecells(addr_t ncells) {
+  addr_t len, p, prev = ADDR_MASK;
 
   /* Find >= ncells of contiguous free memory. */
   for (p = freeptr; p != ADDR_MASK; p = nextfree(p) & ADDR_MASK) {
@@ -65,192 +554,2914 @@ static addr_t alloc(addr_t ncells, uint8_t tag) {
     prev = p;
   }
 
-  if (p == ADDR_MASK) return p; /* Out of memory. */
+#ifdef IBGC_INCREMENTAL_SWEEP
+  /* Sweep until a large enough span turns up, or the sweep is done. */
+  if (p == ADDR_MASK && sweep.p != ADDR_MASK) {
+    sweepcells((size_t) -1, ncells);
+    return takecells(ncells);
+  }
+#endif
 
   /* Remove the cells we found from the free list. */
-  if (len == 1) {
-    next = nextfree(p);
-  } else {
-    next = p + ncells * CELL_SZ;
-    M(next) = nextfree(p);
-    if (len > ncells + 1) {
-      settag(next, gettag(next) | CONT_MASK);
-      M(next + CELL_SZ) = len - ncells;
+  if (p != ADDR_MASK) takespan(prev, p, len, ncells);
+  return p;
+}
+#endif
+
+/* Stores ADDR_MASK in the cells from p up to end. */
+static void clearcells(addr_t p, addr_t end) {
+  for (; p != end; p += CELL_SZ) M(p) = ADDR_MASK;
+}
+
+#ifdef IBGC_IMMIX
+/* The current hole: objects are allocated at bumpptr, up to bumplimit.
+ * The next hole is searched for from holeptr. */
+addr_t bumpptr = ADDR_MASK, bumplimit = ADDR_MASK, holeptr = ALLOC_BASE;
+
+/* Sets the bits in map for the lines that hold the cells from p up to end. */
+static void setlines(unsigned long *map, addr_t p, addr_t end) {
+  size_t i = p / LINE_BYTES, j = (end - 1) / LINE_BYTES;
+
+  for (; i <= j; ++i) map[i / BLOCK_LINES] |= 1UL << (i % BLOCK_LINES);
+}
+
+/* Returns nonzero if the line at p is in use. */
+static int lineisused(addr_t p) {
+  size_t i = p / LINE_BYTES;
+
+  return (lineused[i / BLOCK_LINES] >> (i % BLOCK_LINES)) & 1;
+}
+
+/* Sets the line marks for the object at p. */
+static void marklines(addr_t p) {
+  addr_t end = p;
+
+  for (; hascont(end); end += CELL_SZ);
+  setlines(linemarks, p, end + CELL_SZ);
+}
+
+/*
+ * Free memory is kept in fillers: unmarked objects without pointers,
+ * so that memory can always be walked object by object. Makes p the
+ * first cell of a filler that ends at end. The cells after p must
+ * already be tagged as the rest of a filler.
+ */
+static void fillhead(addr_t p, addr_t end) {
+  settag(p, (end - p > CELL_SZ ? CONT_MASK : 0) | newmark());
+}
+
+/* Makes the cells from p up to end a filler. */
+static void fill(addr_t p, addr_t end) {
+  fillhead(p, end);
+  if (end - p > CELL_SZ) conttags(p + CELL_SZ, end, 0);
+}
+
+/* Turns the cells from p up to end into a filler. Their lines are
+ * reused once a collection finds them unmarked. */
+static void freespan(addr_t p, addr_t end) {
+  clearstarts(p, end);
+  fill(p, end);
+}
+
+/*
+ * Returns the first run of unused lines at or after p that holds at
+ * least size bytes, and stores its end at end. Returns ADDR_MASK if
+ * there is none.
+ */
+static addr_t findhole(addr_t p, addr_t size, addr_t *end) {
+  addr_t q;
+
+  for (p = (p + LINE_BYTES - 1) / LINE_BYTES * LINE_BYTES; p < alloc_top; p = q) {
+    for (; p < alloc_top && lineisused(p); p += LINE_BYTES);
+    for (q = p; q < alloc_top && !lineisused(q); q += LINE_BYTES);
+    if (q - p >= size) {
+      *end = q;
+      return p;
     }
   }
-  if (prev == ADDR_MASK) freeptr = next;
-  else M(prev) = next;
+  return ADDR_MASK;
+}
+
+/*
+ * Turns the hole from p up to end into a single filler, and marks its
+ * lines up to used as in use. Dead objects that extend into the hole
+ * are cut off at its edges. While gc_reclaim() is evacuating, the hole
+ * may hold dead objects it has not reached yet.
+ */
+static void takehole(addr_t p, addr_t end, addr_t used) {
+  if (p > ALLOC_BASE) settag(p - CELL_SZ, gettag(p - CELL_SZ) & ~CONT_MASK);
+  if (end < alloc_top && hascont(end - CELL_SZ)) {
+    settag(end, (gettag(end) & CONT_MASK) | newmark());
+  }
+  freespan(p, end);
+  setlines(lineused, p, used);
+}
+
+/*
+ * Takes ncells cells from the current hole, moving on to the next hole
+ * if they do not fit. Returns their address, or ADDR_MASK if there is
+ * no hole large enough.
+ */
+static addr_t takecells(addr_t ncells) {
+  addr_t end, p, size = ncells * CELL_SZ;
+
+  if ((addr_t) (bumplimit - bumpptr) >= size) {
+    p = bumpptr;
+    bumpptr += size;
+    if (bumpptr != bumplimit) fillhead(bumpptr, bumplimit);
+    return p;
+  }
 
-  /* Set the tag bytes for the newly allocated object. */
-  settag(p, (tag & INFO_MASK) |
-         (ncells > 1 ? CONT_MASK : 0) | (mark_tag ^ MARK_MASK));
-  for (next = p + CELL_SZ, --ncells; ncells != 0; next += CELL_SZ, --ncells) {
-    settag(next, ncells == 1 ? 0 : CONT_MASK);
+  if (size > LINE_BYTES && bumpptr != bumplimit) {
+    /* Rather than give up the rest of the current hole, put an object
+     * larger than a line that does not fit in it in the first hole
+     * that is large enough. Only the lines it occupies are used. */
+    p = findhole(ALLOC_BASE, size, &end);
+    if (p == ADDR_MASK) return p;
+    takehole(p, end, p + size);
+    if (p + size != end) fillhead(p + size, end);
+    return p;
   }
+
+  p = findhole(holeptr, size, &end);
+  if (p == ADDR_MASK) p = findhole(ALLOC_BASE, size, &end);
+  if (p == ADDR_MASK) return p;
+  takehole(p, end, end);
+  bumpptr = p;
+  bumplimit = holeptr = end;
+  return takecells(ncells);
+}
+#endif
+
+#ifdef IBGC_NURSERY
+/*
+ * Copying nursery. When IBGC_NURSERY is defined, objects allocated
+ * outside a collection cycle are bump-allocated in the nursery, from
+ * NURSERY_BASE up to the tags. gc_minor() copies the ones that are
+ * reachable to the rest of memory, the main heap, and empties the
+ * nursery. Objects in the main heap that may point into the nursery
+ * are kept in the remembered set.
+ */
+addr_t nurseryptr = NURSERY_BASE;
+addr_t remembered[REMEMBERED_SIZE];
+size_t nremembered = 0;
+
+/* Set while gc_minor() is promoting objects to the main heap. */
+static int promoting = 0;
+
+static int innursery(addr_t p) { return p >= NURSERY_BASE && p < TAG_BASE; }
+
+/*
+ * Takes ncells cells from the nursery. Returns their address, or
+ * ADDR_MASK if they do not fit, or the objects must go to the main
+ * heap.
+ */
+static addr_t nurserycells(addr_t ncells) {
+  addr_t p = nurseryptr;
+
+  if (gc_phase != GC_IDLE || promoting) return ADDR_MASK;
+  if ((size_t) (TAG_BASE - p) < ncells * CELL_SZ) return ADDR_MASK;
+  nurseryptr += ncells * CELL_SZ;
   return p;
 }
+#endif
 
+#ifdef IBGC_THREADS
 /*
- * Reachability tracing algorithm.
+ * Thread-local allocation buffers. A thread that has called
+ * gc_attach_thread() allocates by bumping a pointer through a buffer
+ * of TLAB_CELLS cells taken from the free list, and only takes
+ * heap_lock to get a new buffer. Objects of TLAB_CELLS cells or more,
+ * and objects allocated by threads that are not attached, are taken
+ * from the free list under the lock, or from the shared span with
+ * IBGC_LOCKFREE. gc_reclaim() returns the unused rest of each buffer
+ * to the free list.
  */
-void gc_trace(addr_t p) {
-  addr_t back = ADDR_MASK, tmp;
+struct tlab {
+  addr_t ptr, limit;
+  int used;
+  /* The thread's roots, registered with gc_thread_roots(). */
+  addr_t *stack;
+  size_t *top;
+};
 
-  /* Only process object if it is not already marked. */
-  if (!isfree(p)) return;
+struct tlab tlabs[MAX_THREADS];
+pthread_mutex_t heap_lock = PTHREAD_MUTEX_INITIALIZER;
+static __thread struct tlab *tlab = 0;
 
-  /* Objects are arranged in a graph which may contain cycles.
-   * We avoid infinite looping by marking an object as soon as we
-   * reach it. When we see an object that is already marked, we
-   * don't process it again.
-   *
-   * When processing an object, we visit each of the object's cells
-   * in turn. If the cell contains a pointer, we follow the pointer
-   * and visit the object it points to. This makes the algorithm
-   * recursive. We want to minimize the amount of memory we use
-   * for the recursion, because it takes away from the memory the
-   * program can use.
-   *
-   * We distinguish two cases:
-   *
-   *  a. If the cell we are currently processing is the last cell
-   *     of the current object, we will not have to do any additional
-   *     processing of the current object, so we can simply replace p
-   *     with the pointer read from the cell.
-   *
-   *  b. If the current object has additional cells after the current
-   *     one, we must continue processing at the next cell of the
-   *     current object after we are done processing the pointed-to
-   *     object. To do this, we maintain a value called "back" that
-   *     points back at the cell we came from when we follow a
-   *     pointer. This value is initially a sentinel value, ADDR_MASK.
-   *     When we find a pointer in the cell pointed to by p, we:
-   *
-   *     1. Store the pointer in a temporary variable "tmp".
-   *
-   *     2. Store the value of back in the cell pointed to by p.
-   *
-   *     3. Set back to p. This will later allow us to restore the
-   *        old value of back.
-   *
-   *     4. Set p to tmp, the pointer we read from the cell.
-   *
-   *     5. Process p.
-   *
-   *     6. If back has the special value ADDR_MASK, exit. We are done.
-   *
-   *     7. Read the value of the cell pointed to by back into tmp.
-   *        This is the old value of back.
-   *
-   *     8. Store p into the cell pointed to by back. This restores
-   *        the original value of that cell.
-   *
-   *     9. Point p at the cell after the cell pointed to by back.
-   *
-   *     10. Set back to tmp. This restores the original value of back.
-   */
-  for (;;) {
-    /* printf("tracing %04x. val %04x tag %02x\n", */
-    /*        p, M(p), gettag(p)); */
-    /* Mark the object now. */
-    mark(p);
-
-    /* If the cell contains a pointer to an unmarked object, follow it. */
-    /* if ((gettag(p) & PTR_MASK)) printf("points to free obj? %d\n", isfree(M(p))); */
-    if ((gettag(p) & PTR_MASK) && isfree(M(p))) {
-      /* Special case for last cell of an object. */
-      if ((gettag(p) & CONT_MASK) == 0) {
-        p = M(p);
-        continue;
-      }
+#define LOCK() pthread_mutex_lock(&heap_lock)
+#define UNLOCK() pthread_mutex_unlock(&heap_lock)
 
-      tmp = M(p);             /* 1. copy the pointer to tmp */
-      M(p) = back;            /* 2. save back at p */
-      back = p;               /* 3. set back to p */
-      p = tmp;                /* 4. set p to pointer */
-      continue;               /* 5. process object at p */
-    }
+/* Returns the unused rest of the buffer t to the free list. */
+static void retire(struct tlab *t) {
+  if (t->ptr != t->limit) freespan(t->ptr, t->limit);
+  t->ptr = t->limit = ADDR_MASK;
+}
+
+#ifdef IBGC_LOCKFREE
+/*
+ * Lock-free allocation. Threads that are not attached, and objects too
+ * large for a buffer, are carved from the front of the shared span, a
+ * free span kept off the free list, with compare-and-swap. sharedspan
+ * packs its address, its length in cells and a version that every
+ * update increments, so that a thread holding an old value cannot
+ * update it after the span was given back and taken again, even at the
+ * same address and length (the ABA problem). Only when the shared span
+ * is too small is heap_lock taken, to return it to the free list and
+ * detach the largest free span in its place. The free list itself is
+ * only changed under the lock.
+ */
+uint64_t sharedspan = 0;
+
+/* If zero, allocation takes heap_lock and the free list, as without
+ * IBGC_LOCKFREE. Only change this while no other thread allocates. */
+int gc_lockfree = 1;
+
+#define SPAN_ADDR(S) ((addr_t) ((S) & 0xffff))
+#define SPAN_CELLS(S) ((addr_t) ((S) >> 16 & 0xffff))
+#define SPAN_VERSION(S) ((uint32_t) ((S) >> 32))
+#define MKSHARED(P, N, V) \
+  ((uint64_t) (uint32_t) (V) << 32 | (uint64_t) (N) << 16 | (P))
+
+/*
+ * Takes ncells cells from the shared span without locking. Returns
+ * their address, or ADDR_MASK if they do not fit. The cells may be
+ * used as a buffer, so the last one is cut off from what follows.
+ */
+static addr_t sharedcells(addr_t ncells) {
+  uint64_t s = __atomic_load_n(&sharedspan, __ATOMIC_ACQUIRE);
+
+  do {
+    if (SPAN_CELLS(s) < ncells || SPAN_CELLS(s) == 0) return ADDR_MASK;
+  } while (!__atomic_compare_exchange_n(
+             &sharedspan, &s,
+             MKSHARED(SPAN_ADDR(s) + ncells * CELL_SZ, SPAN_CELLS(s) - ncells,
+                      SPAN_VERSION(s) + 1),
+             1, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+  cutcells(SPAN_ADDR(s) + ncells * CELL_SZ);
+  return SPAN_ADDR(s);
+}
 
-    /* 6. At this point, if back is ADDR_MASK, we're done. */
-    if (back == ADDR_MASK) break;
+/* Returns the shared span to the free list. Must hold heap_lock. */
+static void unshare() {
+  uint64_t s = __atomic_load_n(&sharedspan, __ATOMIC_ACQUIRE);
 
-    /* Otherwise, return to processing the previous object. */
-    tmp = M(back);              /* 7. read old value of back */
-    M(back) = p;                /* 8. restore old cell value */
-    p = back + CELL_SZ;         /* 9. point p at next cell */
-    back = tmp;                 /* 10. restore old value of back */
+  while (!__atomic_compare_exchange_n(&sharedspan, &s,
+                                      MKSHARED(0, 0, SPAN_VERSION(s) + 1), 1,
+                                      __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+  if (SPAN_CELLS(s)) {
+    freespan(SPAN_ADDR(s), SPAN_ADDR(s) + SPAN_CELLS(s) * CELL_SZ);
   }
 }
 
-/** Return all unmarked objects to the free list. */
-void gc_reclaim() {
-  addr_t end, p = ALLOC_BASE, next_free = freeptr, prev_free = ADDR_MASK;
+/*
+ * Detaches the largest free span from the free list to be the shared
+ * span, which must be empty. Must hold heap_lock.
+ */
+static void share() {
+  addr_t p, prev = ADDR_MASK, best = ADDR_MASK, bestprev = ADDR_MASK;
+  uint64_t s = __atomic_load_n(&sharedspan, __ATOMIC_ACQUIRE);
 
-  for (; p < alloc_top; p = end) {
-    /* printf("p %04x\n", p); */
-    if (p == next_free) {
-      /* Skip memory that is already on the free list. */
-      prev_free = next_free;
-      next_free = nextfree(next_free);
-      end = p + freelen(p) * CELL_SZ;
-      continue;
+  for (p = freeptr; p != ADDR_MASK; prev = p, p = nextfree(p) & ADDR_MASK) {
+    if (best == ADDR_MASK || freelen(p) > freelen(best)) {
+      best = p;
+      bestprev = prev;
     }
+  }
+  if (best == ADDR_MASK) return;
+  if (bestprev == ADDR_MASK) freeptr = nextfree(best);
+  else M(bestprev) = nextfree(best);
+  cutcells(best + freelen(best) * CELL_SZ);
+  __atomic_store_n(&sharedspan,
+                   MKSHARED(best, freelen(best), SPAN_VERSION(s) + 1),
+                   __ATOMIC_RELEASE);
+}
 
-    /* Determine where p ends. If p is followed by another unreachable
-     * object, coalesce their lengths. */
-    end = p;
-    do {
-      for (; gettag(end) & CONT_MASK; end += CELL_SZ);
-      end += CELL_SZ;
-      /* printf("end %04x\n", end); */
-    } while (end != next_free && isfree(end) && isfree(p));
-
-    if (isfree(p)) {
-      if (next_free == freeptr) freeptr = p;
-      if (end == next_free) {
-        /* p ends at next_free. Coalesce. */
-        M(p) = nextfree(next_free);
-        settag(p, gettag(p) | CONT_MASK);
-        M(p + CELL_SZ) = freelen(next_free) + (end - p) / CELL_SZ;
-        end = next_free = M(p);
-        /* printf("coalesced: %04x %04x(%u) next: %04x\n", p, M(p), M(p + CELL_SZ), end); */
-      } else {
-        /* p ends before next_free, create new free span. */
-        M(p) = next_free;
-        if (end > p + CELL_SZ) {
-          M(p + CELL_SZ) = (end - p) / CELL_SZ;
-          settag(p, gettag(p) | CONT_MASK);
-        }
-        /* printf("new free span: %04x %04x(%u)\n", */
-        /*        p, M(p), freelen(p)); */
-      }
+/*
+ * Takes ncells cells from the shared span, replacing it if they do not
+ * fit. Returns their address, or ADDR_MASK if there is not enough
+ * memory. Must hold heap_lock.
+ */
+static addr_t lockedcells(addr_t ncells) {
+  addr_t p;
 
-      /* If there is a previous free span, we need to either coalesce
-       * with it (if the new span starts just after it), or make sure
-       * the previous span points at the new span. */
-      /* printf("prev_free + freelen(%04x): %04x\n", */
-      /*        prev_free, prev_free + freelen(prev_free)); */
-      if (prev_free != ADDR_MASK) {
-        if (p == prev_free + freelen(prev_free) * CELL_SZ) {
-          /* Coalesce. */
-          /* printf("M(%04x) = M(%04x): %04x\n", prev_free, p, M(p)); */
-          M(prev_free) = M(p);
-          M(prev_free + CELL_SZ) = freelen(prev_free) + freelen(p);
-          settag(prev_free, gettag(prev_free) | CONT_MASK);
-          p = prev_free;        /* Point p at beginning of free span */
-        } else {
-          /* Point previous span at new span. */
-          M(prev_free) = p;
-        }
-      }
-      prev_free = p;
-    }
+  if (!gc_lockfree) return takecells(ncells);
+  p = sharedcells(ncells);
+
+  if (p == ADDR_MASK) {
+    unshare();
+    share();
+    p = sharedcells(ncells);
   }
+  return p;
 }
+#else
+#define lockedcells(N) takecells(N)
+#endif
 
-void ibgc_init() {
-  unmark(freeptr);
-  settag(freeptr, gettag(freeptr) | CONT_MASK);
-  M(freeptr) = ADDR_MASK;
-  M(freeptr + CELL_SZ) = (alloc_top - ALLOC_BASE) / CELL_SZ;
+/* Returns the rest of all buffers to the free list. */
+static void retireall() {
+  size_t i;
+
+  LOCK();
+  for (i = 0; i < MAX_THREADS; ++i) if (tlabs[i].used) retire(&tlabs[i]);
+#ifdef IBGC_LOCKFREE
+  unshare();
+#endif
+  UNLOCK();
+}
+
+/* Drops all buffers, when memory is replaced. */
+static void dropbuffers() {
+  size_t i;
+
+  LOCK();
+  for (i = 0; i < MAX_THREADS; ++i) tlabs[i].ptr = tlabs[i].limit = ADDR_MASK;
+#ifdef IBGC_LOCKFREE
+  __atomic_store_n(&sharedspan,
+                   MKSHARED(0, 0, SPAN_VERSION(sharedspan) + 1),
+                   __ATOMIC_RELEASE);
+#endif
+  UNLOCK();
+}
+
+/*
+ * Safepoints. To collect, a thread sets stopping and waits until every
+ * other attached thread has parked in gc_safepoint(). The parked
+ * threads wait on resumed until the collection is done. Both use
+ * heap_lock, which the collector does not hold while it collects.
+ */
+static int stopping = 0;
+static size_t nattached = 0, nparked = 0;
+
+/* The number of threads that are not attached that are in alloc(), and
+ * whether the calling thread is the one collecting. */
+static size_t nallocating = 0;
+static __thread int collecting = 0;
+static pthread_cond_t parked = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t resumed = PTHREAD_COND_INITIALIZER;
+
+/* The time it took for all threads to park in the last collection, and
+ * the longest time so far, in nanoseconds. */
+unsigned long gc_safepoint_ns = 0, gc_safepoint_max_ns = 0;
+
+/* Parks the calling thread until the collection is done. Must hold
+ * heap_lock. */
+static void park() {
+  ++nparked;
+  pthread_cond_signal(&parked);
+  while (stopping) pthread_cond_wait(&resumed, &heap_lock);
+  --nparked;
+}
+
+/**
+ * Gives the calling thread an allocation buffer.
+ *
+ * @return 0 on success, or -1 if MAX_THREADS threads are attached.
+ */
+int gc_attach_thread() {
+  size_t i;
+
+  LOCK();
+  while (stopping) pthread_cond_wait(&resumed, &heap_lock);
+  for (i = 0; i < MAX_THREADS && tlabs[i].used; ++i);
+  if (i < MAX_THREADS) {
+    tlab = &tlabs[i];
+    tlab->ptr = tlab->limit = ADDR_MASK;
+    tlab->used = 1;
+    tlab->stack = 0;
+    ++nattached;
+  }
+  UNLOCK();
+  return i < MAX_THREADS ? 0 : -1;
+}
+
+/** Returns the calling thread's allocation buffer, before it exits. */
+void gc_detach_thread() {
+  if (!tlab) return;
+  LOCK();
+  while (stopping) park();
+  retire(tlab);
+  tlab->used = 0;
+  --nattached;
+  UNLOCK();
+  tlab = 0;
+}
+
+/**
+ * Registers the calling thread's roots: the *top addresses at stack,
+ * which the thread keeps up to date like the shadow stack. They are
+ * traced, and updated when objects move, while the thread is parked.
+ * The thread must be attached.
+ */
+void gc_thread_roots(addr_t *stack, size_t *top) {
+  LOCK();
+  tlab->stack = stack;
+  tlab->top = top;
+  UNLOCK();
+}
+
+/**
+ * Parks the calling thread if a collection is waiting for it. Attached
+ * threads must call this regularly, at points where their roots are
+ * registered. It only reads a flag unless a collection is waiting.
+ */
+void gc_safepoint() {
+  if (!__atomic_load_n(&stopping, __ATOMIC_ACQUIRE) || !tlab) return;
+  LOCK();
+  if (stopping) park();
+  UNLOCK();
+}
+
+/* Ends an allocation started by enteralloc(). */
+static void leavealloc() {
+  if (__atomic_sub_fetch(&nallocating, 1, __ATOMIC_SEQ_CST) == 0 &&
+      __atomic_load_n(&stopping, __ATOMIC_SEQ_CST)) {
+    LOCK();
+    pthread_cond_signal(&parked);
+    UNLOCK();
+  }
+}
+
+/*
+ * Counts a thread that is not attached as allocating, first waiting
+ * for a collection in progress to finish. Such threads are not
+ * stopped, so gc_stop_world() waits for their allocations instead.
+ */
+static void enteralloc() {
+  for (;;) {
+    __atomic_add_fetch(&nallocating, 1, __ATOMIC_SEQ_CST);
+    if (!__atomic_load_n(&stopping, __ATOMIC_SEQ_CST) || collecting) return;
+    leavealloc();
+    LOCK();
+    while (stopping) pthread_cond_wait(&resumed, &heap_lock);
+    UNLOCK();
+  }
+}
+
+/**
+ * Waits until every other attached thread has parked in
+ * gc_safepoint(), and threads that are not attached have left
+ * alloc(), so that a collection can run. If another thread is
+ * collecting, parks the calling thread until it is done first.
+ */
+void gc_stop_world() {
+  struct timespec t0, t1;
+  unsigned long ns;
+
+  LOCK();
+  while (stopping) {
+    if (tlab) park();
+    else pthread_cond_wait(&resumed, &heap_lock);
+  }
+  __atomic_store_n(&stopping, 1, __ATOMIC_SEQ_CST);
+  collecting = 1;
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  while (nparked < nattached - (tlab != 0) ||
+         __atomic_load_n(&nallocating, __ATOMIC_SEQ_CST)) {
+    pthread_cond_wait(&parked, &heap_lock);
+  }
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+  ns = (t1.tv_sec - t0.tv_sec) * 1000000000UL + t1.tv_nsec - t0.tv_nsec;
+  gc_safepoint_ns = ns;
+  if (ns > gc_safepoint_max_ns) gc_safepoint_max_ns = ns;
+  UNLOCK();
+}
+
+/** Releases the threads parked by gc_stop_world(). */
+void gc_start_world() {
+  LOCK();
+  collecting = 0;
+  __atomic_store_n(&stopping, 0, __ATOMIC_RELEASE);
+  pthread_cond_broadcast(&resumed);
+  UNLOCK();
+}
+
+/*
+ * Takes ncells cells from the calling thread's buffer, getting a new
+ * buffer if they do not fit. Returns their address, or ADDR_MASK if
+ * there is not enough memory.
+ */
+static addr_t tlabcells(addr_t ncells) {
+  struct tlab *t = tlab;
+  addr_t p;
+
+  if (t && (size_t) (t->limit - t->ptr) >= ncells * CELL_SZ) {
+    p = t->ptr;
+    t->ptr += ncells * CELL_SZ;
+    return p;
+  }
+
+#ifdef IBGC_LOCKFREE
+  if (gc_lockfree && (!t || ncells >= TLAB_CELLS)) {
+    p = sharedcells(ncells);
+    if (p != ADDR_MASK) return p;
+  }
+#endif
+
+  LOCK();
+  if (!t || ncells >= TLAB_CELLS) {
+    p = lockedcells(ncells);
+  } else {
+    retire(t);
+    p = lockedcells(TLAB_CELLS);
+    if (p == ADDR_MASK) {
+      p = lockedcells(ncells);
+    } else {
+      t->ptr = p + ncells * CELL_SZ;
+      t->limit = p + TLAB_CELLS * CELL_SZ;
+      cutcells(t->limit);
+    }
+  }
+  UNLOCK();
+  return p;
+}
+#else
+#define LOCK() ((void) 0)
+#define UNLOCK() ((void) 0)
+#define lockedcells(N) takecells(N)
+#endif
+
+#ifdef IBGC_REFCOUNT
+/*
+ * Deferred reference counting. refcounts has a byte for every cell.
+ * The one for the first cell of an object counts the references to it
+ * that other objects hold, which must be stored with gc_write().
+ * References from the roots are not counted. New objects, and objects
+ * whose count drops to 0, go in the zero count table, and
+ * gc_drain_zct() frees those that the roots do not point to. Counts
+ * stick at RC_MAX. gc_reclaim() counts all references again, which
+ * corrects the counts of objects freed with cycles or changed without
+ * gc_write().
+ */
+enum { RC_MAX = 0x3f, RC_PINNED = 0x40, RC_INZCT = 0x80 };
+
+uint8_t refcounts[MEM_BYTES / CELL_SZ];
+addr_t zct[ZCT_SIZE];
+size_t nzct = 0;
+
+#define REFCOUNT(P) refcounts[(P) / CELL_SZ]
+
+/* Adds the object at p to the zero count table, unless it is there
+ * already or the table is full. */
+static void addzct(addr_t p) {
+  if ((REFCOUNT(p) & RC_INZCT) || nzct == ZCT_SIZE) return;
+  REFCOUNT(p) |= RC_INZCT;
+  zct[nzct++] = p;
+}
+#endif
+
+#ifdef IBGC_REGIONS
+/*
+ * Regions. A region is a span taken from the free list, in which
+ * gc_region_alloc() allocates objects by bumping ptr up to limit. The
+ * objects in a region are all kept alive, and traced as roots, until
+ * gc_region_release() returns the whole span to the free list. The
+ * cells from ptr up to limit form a raw object, so that the rest of
+ * the collector sees only objects. base is ADDR_MASK for regions that
+ * are not open.
+ */
+struct region {
+  addr_t base, ptr, limit;
+};
+
+struct region regions[MAX_REGIONS];
+
+/* Returns nonzero if p is in an open region. */
+static int inregion(addr_t p) {
+  size_t i;
+
+  for (i = 0; i < MAX_REGIONS; ++i) {
+    if (regions[i].base != ADDR_MASK && p >= regions[i].base &&
+        p < regions[i].limit) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/*
+ * Makes p the first cell of a raw object without contents that ends at
+ * end. The cells after p must already be tagged as the rest of one.
+ */
+static void rawhead(addr_t p, addr_t end) {
+  settag(p, KIND_RAW | (end - p > CELL_SZ ? CONT_MASK : 0) | newmark());
+  setstart(p);
+}
+
+/* Makes the cells from p up to end a raw object without contents. */
+static void rawfill(addr_t p, addr_t end) {
+  rawhead(p, end);
+  if (end - p > CELL_SZ) conttags(p + CELL_SZ, end, KIND_RAW);
+}
+#else
+static int inregion(addr_t p) { return 0; }
+#endif
+
+#ifdef IBGC_TREADMILL
+/*
+ * Treadmill. With IBGC_TREADMILL, memory above the list sentinels is
+ * divided into pages of TREADMILL_PAGE bytes, and each page into slots
+ * of one size class. A slot is a header cell holding the links of a
+ * circular, doubly linked list, followed by the cells of an object.
+ * Every class has a list of free slots and lists of white, black and
+ * black objects that hold weak references; gray objects of all classes
+ * share one list. Allocation and shading move a slot between lists in
+ * constant time, and so does the flip at the end of a cycle, which
+ * makes white objects free and black objects white by splicing lists.
+ * While a cycle is in progress, every allocation scans
+ * TREADMILL_QUANTUM cells of gray objects (see gc_step()). Only that
+ * much work is done by an allocation that finds a free slot of its
+ * class: one that does not finishes the cycle, or does a whole one,
+ * at once.
+ */
+typedef char treadmill_links_fit_in_a_cell[
+  CELL_SZ >= 2 * sizeof(addr_t) ? 1 : -1];
+
+enum { TM_FREE, TM_WHITE, TM_BLACK, TM_WEAKBLACK, TM_LISTS };
+
+/* The next and previous slot of the slot at p, kept in its header. */
+#define TM_NEXT(P) (((addr_t *) (mem + (P) - CELL_SZ))[0])
+#define TM_PREV(P) (((addr_t *) (mem + (P) - CELL_SZ))[1])
+
+/* A sentinel is only a header; its address is the cell after it. */
+#define TM_SENTINEL(I) (ALLOC_BASE + ((I) + 1) * CELL_SZ)
+#define TM_LIST(C, L) TM_SENTINEL((C) * TM_LISTS + (L))
+#define TM_GRAY TM_SENTINEL(TREADMILL_CLASSES * TM_LISTS)
+#define TM_SENTINELS (TREADMILL_CLASSES * TM_LISTS + 1)
+#define TM_PAGES (ALLOC_BASE + TM_SENTINELS * CELL_SZ)
+
+uint8_t pageclass[MEM_BYTES / TREADMILL_PAGE];
+addr_t nextpage = TM_PAGES;
+
+/* The number of slots of each class, of free ones, and of marked
+ * objects, which are the ones left when the cycle finishes. */
+size_t nslots[TREADMILL_CLASSES], nfree[TREADMILL_CLASSES];
+size_t nmarked[TREADMILL_CLASSES];
+
+/* Set while a cycle started by gc_step() is in progress. */
+static int stepping = 0;
+
+int gc_step(size_t n);
+
+/* Returns the size class of the slot at p. */
+static unsigned slotclass(addr_t p) {
+  return pageclass[(p - TM_PAGES) / TREADMILL_PAGE];
+}
+
+/* Links the slot at p in at the end of list. */
+static void tmlink(addr_t p, addr_t list) {
+  TM_NEXT(p) = list;
+  TM_PREV(p) = TM_PREV(list);
+  TM_NEXT(TM_PREV(list)) = p;
+  TM_PREV(list) = p;
+}
+
+/* Unlinks the slot at p from the list it is in. */
+static void tmunlink(addr_t p) {
+  TM_NEXT(TM_PREV(p)) = TM_NEXT(p);
+  TM_PREV(TM_NEXT(p)) = TM_PREV(p);
+}
+
+/* Moves the slot at p to the end of the list l of its class. */
+static void tmmove(addr_t p, unsigned l) {
+  tmunlink(p);
+  tmlink(p, TM_LIST(slotclass(p), l));
+}
+
+/* Moves all slots in list from to the end of list to. */
+static void tmsplice(addr_t from, addr_t to) {
+  addr_t first = TM_NEXT(from), last = TM_PREV(from);
+
+  if (first == from) return;
+  TM_NEXT(TM_PREV(to)) = first;
+  TM_PREV(first) = TM_PREV(to);
+  TM_NEXT(last) = to;
+  TM_PREV(to) = last;
+  TM_NEXT(from) = TM_PREV(from) = from;
+}
+
+/*
+ * Divides the next unused page into free slots of class c. Returns 0 if
+ * all pages are in use.
+ */
+static int carve(unsigned c) {
+  addr_t p, end, slot = ((1 << c) + 1) * CELL_SZ;
+
+  if ((size_t) (alloc_top - nextpage) < TREADMILL_PAGE) return 0;
+  pageclass[(nextpage - TM_PAGES) / TREADMILL_PAGE] = c;
+  end = nextpage + TREADMILL_PAGE;
+  for (p = nextpage; (size_t) (end - p) >= slot; p += slot) {
+    settag(p, 0);
+    tmlink(p + CELL_SZ, TM_LIST(c, TM_FREE));
+    ++nslots[c];
+    ++nfree[c];
+  }
+  nextpage = end;
+  return 1;
+}
+
+/*
+ * Takes a slot for ncells cells, doing a step of collection work if a
+ * cycle is in progress, and starting one when few pages are unused and
+ * few slots of the class are free. Finishes the cycle if none are.
+ * Returns the address of the slot, or ADDR_MASK if the object is too
+ * large or there is not enough memory.
+ */
+static addr_t tmcells(addr_t ncells) {
+  unsigned c = 0;
+  addr_t p, free;
+
+  while (c < TREADMILL_CLASSES && (1UL << c) < ncells) ++c;
+  if (c == TREADMILL_CLASSES) return ADDR_MASK;
+  free = TM_LIST(c, TM_FREE);
+  if (stepping || (gc_phase == GC_IDLE &&
+                   (size_t) (alloc_top - nextpage) <
+                   TREADMILL_CLASSES * TREADMILL_PAGE &&
+                   nfree[c] * 100 < nslots[c] * TREADMILL_THRESHOLD)) {
+    gc_step(TREADMILL_QUANTUM);
+  }
+  if (TM_NEXT(free) == free && !carve(c) &&
+      (stepping || gc_phase == GC_IDLE)) {
+    gc_step((size_t) -1);
+  }
+  p = TM_NEXT(free);
+  if (p == free) return ADDR_MASK;
+  --nfree[c];
+  /* Objects allocated during a collection cycle are black. */
+  if (gc_phase == GC_IDLE) {
+    tmmove(p, TM_WHITE);
+  } else {
+    tmmove(p, TM_BLACK);
+    ++nmarked[c];
+  }
+  return p;
+}
+#endif
+
+/* Tags the ncells cells at p as a new object with the given tag. */
+static void initobj(addr_t p, addr_t ncells, uint8_t tag) {
+  /* Objects allocated during a collection cycle are born marked. */
+  settag(p, (tag & (INFO_MASK | KIND_MASK)) | (ncells > 1 ? CONT_MASK : 0) |
+         newmark());
+  if (ncells > 1) conttags(p + CELL_SZ, p + ncells * CELL_SZ, tag & KIND_MASK);
+  setstart(p);
+#ifdef IBGC_IMMIX
+  if (gc_phase != GC_IDLE) setlines(linemarks, p, p + ncells * CELL_SZ);
+#endif
+  if ((tag & KIND_MASK) == KIND_PTRS || (tag & KIND_MASK) == KIND_EPHEMERON) {
+    clearcells(p, p + ncells * CELL_SZ);
+  }
+#ifdef IBGC_REFCOUNT
+  REFCOUNT(p) = 0;
+#endif
+}
+
+/**
+ * Allocates ncells cells of memory and tags them with the given tag.
+ * The tag can contain the info bit for the first cell and the kind of
+ * the object. The cells of KIND_PTRS and KIND_EPHEMERON objects are set
+ * to ADDR_MASK.
+ *
+ * @return the address of the first cell, or ADDR_MASK if allocation
+ *   failed (no large enough contiguous span of free cells was found).
+ */
+static addr_t alloc(addr_t ncells, uint8_t tag) {
+#ifdef IBGC_NURSERY
+  addr_t p = nurserycells(ncells);
+
+  if (p == ADDR_MASK) p = takecells(ncells);
+#elif defined(IBGC_THREADS)
+  int attached = tlab != 0;
+  addr_t p;
+
+  if (!attached) enteralloc();
+  p = tlabcells(ncells);
+#elif defined(IBGC_TREADMILL)
+  addr_t p = tmcells(ncells);
+#else
+  addr_t p = takecells(ncells);
+#endif
+
+  if (p != ADDR_MASK) {
+    initobj(p, ncells, tag);
+#ifdef IBGC_REFCOUNT
+    addzct(p);
+#endif
+  }
+#ifdef IBGC_THREADS
+  if (!attached) leavealloc();
+#endif
+  return p;
+}
+
+/* Returns the address of the object the pointer p points into. */
+static addr_t ptrobj(addr_t p) {
+#ifdef IBGC_INTERIOR
+  return objstart(p);
+#else
+  return p;
+#endif
+}
+
+#ifdef IBGC_REFCOUNT
+/* Counts a reference to the object p points into. */
+static void retain(addr_t p) {
+  p = ptrobj(p);
+  if ((REFCOUNT(p) & RC_MAX) != RC_MAX) ++REFCOUNT(p);
+}
+
+/* Uncounts a reference to the object p points into, and adds it to
+ * the zero count table if that was the last one. */
+static void release(addr_t p) {
+  uint8_t n;
+
+  p = ptrobj(p);
+  n = REFCOUNT(p) & RC_MAX;
+  if (n == 0 || n == RC_MAX) return;
+  if (--REFCOUNT(p) & RC_MAX) return;
+  addzct(p);
+}
+
+/* Makes the count of the object p points into stick, so that only a
+ * collection can free it. */
+static void stick(addr_t p) {
+  p = ptrobj(p);
+  REFCOUNT(p) |= RC_MAX;
+}
+
+/* Returns nonzero if the cell at p holds a counted reference: one the
+ * tracer follows. */
+static int counted(addr_t p) { return isptr(p); }
+
+/* Returns nonzero if the cell at p holds a reference that is not
+ * counted: a weak reference, or one held by an ephemeron. Objects are
+ * not freed early while such references to them may exist. */
+static int uncounted(addr_t p) {
+  return (addr_t) M(p) != ADDR_MASK && !isptr(p) &&
+    ((gettag(p) & WEAK_MASK) || kind(p) == KIND_EPHEMERON);
+}
+
+/* Counts the references held by the cells from p up to end. */
+static void recount(addr_t p, addr_t end) {
+  for (; p != end; p += CELL_SZ) {
+    if (counted(p)) retain(M(p));
+    else if (uncounted(p)) stick(M(p));
+  }
+}
+
+/* Removes the object at p from the zero count table. */
+static void dropzct(addr_t p) {
+  size_t i;
+
+  if (!(REFCOUNT(p) & RC_INZCT)) return;
+  for (i = 0; zct[i] != p; ++i);
+  zct[i] = zct[--nzct];
+  REFCOUNT(p) &= ~RC_INZCT;
+}
+#endif
+
+#ifndef IBGC_TREADMILL
+/*
+ * The tracer visits the cells of an object starting at the cell it
+ * entered the object through. With interior pointers, that need not be
+ * the first cell, so it wraps around to the first cell after the last,
+ * and the entry cell is tagged with SCRATCH_MASK so that the tracer
+ * can tell where to stop.
+ */
+static addr_t enter(addr_t p) {
+#ifdef IBGC_INTERIOR
+  settag(p, gettag(p) | SCRATCH_MASK);
+#endif
+  return p;
+}
+
+/* Returns the cell the tracer visits after p. */
+static addr_t nextcell(addr_t p) {
+#ifdef IBGC_INTERIOR
+  if (!hascont(p)) return objstart(p);
+#endif
+  return p + CELL_SZ;
+}
+
+/* Returns nonzero if p is the last cell of its object the tracer visits. */
+static int lastcell(addr_t p) {
+#ifdef IBGC_INTERIOR
+  return (gettag(nextcell(p)) & SCRATCH_MASK) != 0;
+#else
+  return !hascont(p);
+#endif
+}
+
+/*
+ * Called when the tracer is done with the object p is the last visited
+ * cell of. Returns the address the tracer entered the object through.
+ */
+static addr_t leave(addr_t p) {
+#ifdef IBGC_INTERIOR
+  p = nextcell(p);
+  settag(p, gettag(p) & ~SCRATCH_MASK);
+  return p;
+#else
+  return objstart(p);
+#endif
+}
+#endif
+
+/* Ephemerons the tracer has found but not resolved yet, linked through
+ * EPHEMERON_LINK. */
+static addr_t ephemerons = ADDR_MASK;
+
+/*
+ * Called when the tracer marks the object at p. Returns nonzero if the
+ * tracer should visit the object's cells. Ephemerons are not visited,
+ * but added to the list of ephemerons to resolve. With IBGC_IMMIX, the
+ * object's lines are marked.
+ */
+static int visit(addr_t p) {
+#ifdef IBGC_IMMIX
+  marklines(p);
+#endif
+  switch (kind(p)) {
+  case KIND_RAW: return 0;
+  case KIND_EPHEMERON:
+    EPHEMERON_LINK(p) = ephemerons;
+    ephemerons = p;
+    return 0;
+  default: return 1;
+  }
+}
+
+#ifdef IBGC_TREADMILL
+/* Moves the marked object at p to the gray list, to be scanned. */
+static void gray(addr_t p) {
+  settag(p, gettag(p) | SCRATCH_MASK);
+  tmunlink(p);
+  tmlink(p, TM_GRAY);
+}
+
+/* Marks the object p points to and makes it gray, unless it is marked
+ * already. */
+static void shade(addr_t p) {
+  if (!isfree(p)) return;
+  mark(p);
+  ++nmarked[slotclass(p)];
+  gray(p);
+}
+
+/*
+ * Scans gray objects, shading the objects they point to, until about n
+ * cells have been scanned. Scanned objects become black, and go on the
+ * weak black list of their class if they hold weak references. Returns
+ * nonzero if gray objects are left.
+ */
+static int scan(size_t n) {
+  addr_t p, q;
+  int weak;
+
+  while ((p = TM_NEXT(TM_GRAY)) != TM_GRAY) {
+    if (!n) return 1;
+    settag(p, gettag(p) & ~SCRATCH_MASK);
+    weak = 0;
+    if (visit(p)) {
+      for (q = p; ; q += CELL_SZ) {
+        if (isptr(q)) shade(M(q));
+        else if ((gettag(q) & WEAK_MASK) && (addr_t) M(q) != ADDR_MASK) {
+          weak = 1;
+        }
+        if (n) --n;
+        if (!hascont(q)) break;
+      }
+    } else if (n) {
+      --n;
+    }
+    tmmove(p, weak ? TM_WEAKBLACK : TM_BLACK);
+  }
+  return 0;
+}
+
+/*
+ * Traces everything reachable from p, which must point to an object
+ * that has just been marked, by making it gray and scanning until no
+ * gray objects are left.
+ */
+static void trace(addr_t p) {
+  ++nmarked[slotclass(p)];
+  gray(p);
+  scan((size_t) -1);
+}
+#else
+/*
+ * Reachability tracing algorithm. Traces everything reachable from p.
+ * The object p points into must already have been marked.
+ */
+static void trace(addr_t p) {
+  addr_t back = ADDR_MASK, obj, tmp;
+
+  /* Objects without pointers do not need to be processed. */
+  if (!visit(ptrobj(p))) return;
+  enter(p);
+
+  /* Objects are arranged in a graph which may contain cycles.
+   * We avoid infinite looping by marking an object as soon as we
+   * reach it. When we see an object that is already marked, we
+   * don't process it again.
+   *
+   * When processing an object, we visit each of the object's cells
+   * in turn. If the cell contains a pointer, we follow the pointer
+   * and visit the object it points to. This makes the algorithm
+   * recursive. We want to minimize the amount of memory we use
+   * for the recursion, because it takes away from the memory the
+   * program can use.
+   *
+   * We distinguish two cases:
+   *
+   *  a. If the cell we are currently processing is the last cell
+   *     of the object we started at, we will not have to do any
+   *     additional processing, so we can simply replace p with the
+   *     pointer read from the cell.
+   *
+   *  b. Otherwise, we must continue processing at the next cell of
+   *     the current object (or return to the object we came from)
+   *     after we are done processing the pointed-to object. To do
+   *     this, we maintain a value called "back" that points back at
+   *     the cell we came from when we follow a pointer. This value
+   *     is initially a sentinel value, ADDR_MASK. When we find a
+   *     pointer in the cell pointed to by p, we:
+   *
+   *     1. Store the pointer in a temporary variable "tmp".
+   *
+   *     2. Store the value of back in the cell pointed to by p.
+   *
+   *     3. Set back to p. This will later allow us to restore the
+   *        old value of back.
+   *
+   *     4. Set p to tmp, the pointer we read from the cell.
+   *
+   *     5. Process p, moving p along the cells of the object.
+   *
+   *     6. When p reaches the last cell of the object, if back has
+   *        the special value ADDR_MASK, exit. We are done.
+   *
+   *     7. Read the value of the cell pointed to by back into tmp.
+   *        This is the old value of back.
+   *
+   *     8. Store the address p entered its object through into the
+   *        cell pointed to by back. This restores the original value
+   *        of that cell.
+   *
+   *     9. Point p at the cell pointed to by back, and continue with
+   *        the cell after it (or go back to step 6 if it was the
+   *        last cell of its object).
+   *
+   *     10. Set back to tmp. This restores the original value of back.
+   */
+  for (;;) {
+    /* If the cell contains a pointer to an unmarked object, mark the
+     * object and follow the pointer, unless the object has no pointers
+     * to follow. */
+    tmp = M(p);
+    if (isptr(p) && isfree(obj = ptrobj(tmp))) {
+      mark(obj);
+      if (visit(obj)) {
+        /* Special case for last cell of the object we started at. */
+        if (back == ADDR_MASK && lastcell(p)) {
+          leave(p);
+          p = enter(tmp);
+          continue;
+        }
+
+        M(p) = back;            /* 2. save back at p */
+        back = p;               /* 3. set back to p */
+        p = enter(tmp);         /* 4. set p to pointer */
+        continue;               /* 5. process object at p */
+      }
+    }
+
+    while (lastcell(p)) {
+      obj = leave(p);
+
+      /* 6. At this point, if back is ADDR_MASK, we're done. */
+      if (back == ADDR_MASK) return;
+
+      /* Otherwise, return to processing the previous object. */
+      tmp = M(back);            /* 7. read old value of back */
+      M(back) = obj;            /* 8. restore old cell value */
+      p = back;                 /* 9. point p at that cell */
+      back = tmp;               /* 10. restore old value of back */
+    }
+    p = nextcell(p);
+  }
+}
+#endif
+
+/** Marks everything reachable from the root p. */
+void gc_trace(addr_t p) {
+  /* Only process object if it is not already marked. */
+  if (!isfree(ptrobj(p))) return;
+  mark(ptrobj(p));
+  trace(p);
+}
+
+/**
+ * If set, gc_trace_roots() hands each root that is not yet marked to
+ * this function instead of tracing it itself. This allows roots to be
+ * queued for, or distributed among, other markers.
+ */
+void (*gc_marker)(addr_t p) = 0;
+
+/**
+ * Marks everything reachable from the n roots at roots. Roots that are
+ * ADDR_MASK or already marked are skipped.
+ */
+void gc_trace_roots(addr_t *roots, size_t n) {
+  addr_t p;
+  size_t i;
+
+  for (i = 0; i < n; ++i) {
+    /* ADDR_MASK has no tag inside mem, so don't form its address. */
+    if (i + PREFETCH_AHEAD < n && roots[i + PREFETCH_AHEAD] != ADDR_MASK) {
+      PREFETCH(mem + tagaddr(roots[i + PREFETCH_AHEAD]));
+    }
+    p = roots[i];
+    if (p == ADDR_MASK || !isfree(ptrobj(p))) continue;
+    if (gc_marker) {
+      gc_marker(p);
+    } else {
+      mark(ptrobj(p));
+      trace(p);
+    }
+  }
+}
+
+/*
+ * Built-in root set. The shadow stack holds the addresses that are
+ * live in the program's active frames: a frame pushes its roots on
+ * entry, updates them through the returned slots, and pops them on
+ * exit. The root table holds the locations of long-lived roots, such
+ * as global variables.
+ */
+addr_t shadow_stack[SHADOW_STACK_SIZE];
+addr_t *root_table[ROOT_TABLE_SIZE];
+size_t shadow_top = 0, nroots = 0;
+
+/**
+ * Pushes p onto the shadow stack.
+ *
+ * @return the slot p was stored in, or 0 if the shadow stack is full.
+ */
+addr_t *gc_push_root(addr_t p) {
+  if (shadow_top == SHADOW_STACK_SIZE) return 0;
+  shadow_stack[shadow_top] = p;
+  return &shadow_stack[shadow_top++];
+}
+
+/** Pops n roots off the shadow stack. */
+void gc_pop_roots(size_t n) {
+  shadow_top -= n;
+}
+
+/**
+ * Adds the variable at p to the root table.
+ *
+ * @return 0 on success, -1 if the root table is full.
+ */
+int gc_add_root(addr_t *p) {
+  if (nroots == ROOT_TABLE_SIZE) return -1;
+  root_table[nroots++] = p;
+  return 0;
+}
+
+/** Removes the variable at p from the root table. */
+void gc_remove_root(addr_t *p) {
+  size_t i;
+
+  for (i = 0; i < nroots; ++i) {
+    if (root_table[i] == p) {
+      root_table[i] = root_table[--nroots];
+      return;
+    }
+  }
+}
+
+/**
+ * Traces the roots on the shadow stack and in the root table, and with
+ * IBGC_THREADS, those registered by attached threads.
+ */
+void gc_trace_registered() {
+  addr_t p;
+  size_t i;
+
+  gc_trace_roots(shadow_stack, shadow_top);
+#ifdef IBGC_THREADS
+  for (i = 0; i < MAX_THREADS; ++i) {
+    if (tlabs[i].used && tlabs[i].stack) {
+      gc_trace_roots(tlabs[i].stack, *tlabs[i].top);
+    }
+  }
+#endif
+  for (i = 0; i < nroots; ++i) {
+    if (i + PREFETCH_AHEAD < nroots) PREFETCH(root_table[i + PREFETCH_AHEAD]);
+    p = *root_table[i];
+    if (p != ADDR_MASK) gc_trace(p);
+  }
+}
+
+/*
+ * Traces the values of the ephemerons found so far whose keys have been
+ * marked. This can mark more keys and find more ephemerons, so repeat
+ * until no more values are traced. The ephemerons left on the list
+ * have unreachable keys.
+ */
+static void traceephemerons() {
+  addr_t p, list;
+  int progress;
+
+  do {
+    progress = 0;
+    list = ephemerons;
+    ephemerons = ADDR_MASK;
+    while (list != ADDR_MASK) {
+      p = list;
+      list = EPHEMERON_LINK(p);
+      if ((addr_t) M(p) != ADDR_MASK && !isfree(ptrobj(M(p)))) {
+        EPHEMERON_LINK(p) = ADDR_MASK;
+        if ((addr_t) M(p + CELL_SZ) != ADDR_MASK) gc_trace(M(p + CELL_SZ));
+        progress = 1;
+      } else {
+        EPHEMERON_LINK(p) = ephemerons;
+        ephemerons = p;
+      }
+    }
+  } while (progress);
+}
+
+/* Clears the ephemerons left with unreachable keys by traceephemerons(). */
+static void clearephemerons() {
+  addr_t p;
+
+  while (ephemerons != ADDR_MASK) {
+    p = ephemerons;
+    ephemerons = EPHEMERON_LINK(p);
+    M(p) = M(p + CELL_SZ) = EPHEMERON_LINK(p) = ADDR_MASK;
+  }
+}
+
+/*
+ * Finalization. final_table holds the objects registered with
+ * gc_register_finalizer(). When gc_finish() finds one of them
+ * unreachable, it moves it to final_queue and traces it, so that the
+ * object and everything it points to survive until the program has
+ * drained it from the queue.
+ */
+addr_t final_table[FINAL_TABLE_SIZE];
+addr_t final_queue[FINAL_QUEUE_SIZE];
+size_t nfinal = 0, nqueued = 0;
+
+/**
+ * Registers the object at p for finalization.
+ *
+ * @return 0 on success, or -1 if the finalization table is full.
+ */
+int gc_register_finalizer(addr_t p) {
+  if (nfinal == FINAL_TABLE_SIZE) return -1;
+  final_table[nfinal++] = p;
+  return 0;
+}
+
+/**
+ * Removes the object at p from the finalization table, e.g. before
+ * freeing it with gc_free().
+ */
+void gc_unregister_finalizer(addr_t p) {
+  size_t i;
+
+  for (i = 0; i < nfinal; ++i) {
+    if (final_table[i] == p) {
+      final_table[i] = final_table[--nfinal];
+      return;
+    }
+  }
+}
+
+/**
+ * Moves up to n objects from the finalization queue to buf. Each
+ * object is handed out once; after that, it is freed by the first
+ * collection that finds it unreachable.
+ *
+ * @return the number of objects stored in buf.
+ */
+size_t gc_drain_finalizers(addr_t *buf, size_t n) {
+  if (n > nqueued) n = nqueued;
+  nqueued -= n;
+  memcpy(buf, final_queue + nqueued, n * sizeof(addr_t));
+  return n;
+}
+
+/*
+ * Keeps the objects on the finalization queue alive, and moves the
+ * registered objects that are unreachable onto it. Registered objects
+ * that do not fit on the queue are kept alive, and queued by a later
+ * collection.
+ */
+static void finalize() {
+  size_t i, n = nqueued;
+
+  for (i = 0; i < n; ++i) gc_trace(final_queue[i]);
+  /* Find all unreachable registered objects before tracing any of
+   * them, so that objects reachable only from other registered
+   * objects are queued as well. */
+  for (i = 0; i < nfinal; ) {
+    if (nqueued < FINAL_QUEUE_SIZE && isfree(ptrobj(final_table[i]))) {
+      final_queue[nqueued++] = final_table[i];
+      final_table[i] = final_table[--nfinal];
+    } else {
+      ++i;
+    }
+  }
+  for (i = n; i < nqueued; ++i) gc_trace(final_queue[i]);
+  for (i = 0; i < nfinal; ++i) gc_trace(final_table[i]);
+}
+
+#ifdef IBGC_CONSERVATIVE
+/**
+ * The end of the stack that gc_trace_stack() scans up to. The program
+ * should set this to the address of a local variable in a function,
+ * e.g. main(), that calls all functions that keep addresses in local
+ * variables. The scan does not cover that function's own frame.
+ */
+void *gc_stack_base = 0;
+
+/*
+ * Traces every addr_t-aligned value in the n bytes at p that is the
+ * address of an object.
+ */
+NO_SANITIZE_ADDRESS static void scanrange(char *p, size_t n) {
+  addr_t a;
+
+  for (; n >= sizeof(addr_t); p += sizeof(addr_t), n -= sizeof(addr_t)) {
+    a = *(addr_t*) p;
+    if (a < ALLOC_BASE || a >= alloc_top || a % CELL_SZ) continue;
+
+    /* Each word of the object start bitmap covers a page of cells.
+     * Most values that are not addresses land on pages without any
+     * objects and are rejected with a single load. */
+    if (!objstarts[a / CELL_SZ / LONG_BITS]) continue;
+    if (isstart(a)) gc_trace(a);
+  }
+}
+
+/**
+ * Conservatively traces the native stack and registers of the calling
+ * thread: every value on the stack, between the caller and
+ * gc_stack_base, that is the address of the first cell of an object
+ * is treated as a root.
+ */
+NOINLINE void gc_trace_stack() {
+  jmp_buf regs;
+  char *top = (char*) &regs, *base = gc_stack_base;
+
+  /* The addresses found cannot be updated, so objects must not move. */
+  canmove = 0;
+
+  /* Spill registers that may hold addresses into regs. setjmp() may
+   * mangle some of them, so where possible, also have the compiler
+   * save all callee-saved registers in this function's frame. */
+#ifdef __GNUC__
+  __builtin_unwind_init();
+#endif
+  setjmp(regs);
+  scanrange((char*) &regs, sizeof(regs));
+  if (top < base) scanrange(top, base - top);
+  else scanrange(base, top - base);
+}
+#endif
+
+#if defined(IBGC_COMPACT) || defined(IBGC_IMMIX)
+/* Returns the number of set bits in w. */
+static unsigned popcount(unsigned long w) {
+#ifdef __GNUC__
+  return __builtin_popcountl(w);
+#else
+  unsigned n = 0;
+  for (; w; w &= w - 1) ++n;
+  return n;
+#endif
+}
+#endif
+
+#if defined(IBGC_COMPACT) || defined(IBGC_IMMIX) || defined(IBGC_REGIONS)
+/*
+ * Returns nonzero if the cell at p holds an address that must be
+ * updated when objects move: a pointer, a weak reference or a cell of
+ * an ephemeron.
+ */
+static int isref(addr_t p) {
+  if ((addr_t) M(p) == ADDR_MASK) return 0;
+  return isptr(p) || (gettag(p) & WEAK_MASK) || kind(p) == KIND_EPHEMERON;
+}
+
+#endif
+
+#if defined(IBGC_COMPACT) || defined(IBGC_IMMIX) || defined(IBGC_NURSERY)
+/* Replaces each of the n addresses at a that is not ADDR_MASK by f(it). */
+static void maparray(addr_t *a, size_t n, addr_t (*f)(addr_t)) {
+  for (; n; --n, ++a) if (*a != ADDR_MASK) *a = f(*a);
+}
+
+/*
+ * Updates the addresses on the shadow stack, in the root table and in
+ * the finalization table and queue after objects have moved. f maps
+ * an old address to the new one.
+ */
+static void maproots(addr_t (*f)(addr_t)) {
+  size_t i;
+
+  maparray(shadow_stack, shadow_top, f);
+  for (i = 0; i < nroots; ++i) maparray(root_table[i], 1, f);
+#ifdef IBGC_THREADS
+  for (i = 0; i < MAX_THREADS; ++i) {
+    if (tlabs[i].used && tlabs[i].stack) {
+      maparray(tlabs[i].stack, *tlabs[i].top, f);
+    }
+  }
+#endif
+  maparray(final_table, nfinal, f);
+  maparray(final_queue, nqueued, f);
+#ifdef IBGC_REFCOUNT
+  maparray(zct, nzct, f);
+#endif
+}
+#endif
+
+/*
+ * If the cell at p is a weak reference to an unreachable object,
+ * clears it to ADDR_MASK.
+ */
+static void clearweak(addr_t p) {
+  if ((gettag(p) & WEAK_MASK) && (addr_t) M(p) != ADDR_MASK && isfree(M(p))) {
+    M(p) = ADDR_MASK;
+  }
+}
+
+#if defined(IBGC_IMMIX) || defined(IBGC_INCREMENTAL_SWEEP)
+/*
+ * Clears the weak references to unreachable objects in all of memory.
+ * The tags are searched for the weak bit a word at a time. Free spans
+ * and fillers do not have it in the cells that hold their link and
+ * length, and the other cells with it belong to objects or hold
+ * leftovers of them, so only the addresses they hold are checked.
+ */
+static void clearweakrefs() {
+  addr_t p, q;
+  unsigned long w;
+
+  for (p = ALLOC_BASE; p < alloc_top; p += sizeof(long) * CELL_SZ) {
+    memcpy(&w, mem + tagaddr(p), sizeof(long));
+    if (!(w & TAGWORD(WEAK_MASK))) continue;
+    for (q = p; q != p + sizeof(long) * CELL_SZ && q < alloc_top; q += CELL_SZ) {
+      if ((addr_t) M(q) < alloc_top) clearweak(q);
+    }
+  }
+}
+#endif
+
+#ifdef IBGC_NURSERY
+/* Nursery objects that have been promoted, but whose cells have not
+ * been scanned yet, linked through their second cell. */
+static addr_t pending = ADDR_MASK;
+
+/* Returns nonzero if the cell at p holds a reference a minor collection
+ * follows. Ephemerons are only resolved by full collections, so their
+ * keys and values are treated as ordinary pointers. */
+static int isstrong(addr_t p) {
+  return isptr(p) || kind(p) == KIND_EPHEMERON;
+}
+
+/*
+ * Copies the nursery object at p to the main heap, and leaves the new
+ * address in its first cell, which is tagged with SCRATCH_MASK. If the
+ * object has more than one cell, it is put on the pending list.
+ */
+static addr_t copyobj(addr_t p) {
+  addr_t end = p, i, n, q;
+
+  for (; hascont(end); end += CELL_SZ);
+  n = (end - p) / CELL_SZ + 1;
+  q = alloc(n, gettag(p));
+  memcpy(mem + q, mem + p, n * CELL_SZ);
+  for (i = 0; i < n * CELL_SZ; i += CELL_SZ) {
+    settag(q + i, (gettag(q + i) & ~CELL_BITS) | (gettag(p + i) & CELL_BITS));
+  }
+  M(p) = q;
+  settag(p, gettag(p) | SCRATCH_MASK);
+  if (n > 1) {
+    M(p + CELL_SZ) = pending;
+    pending = p;
+  }
+  return q;
+}
+
+/*
+ * If the cell at p points into the nursery, promotes the object it
+ * points into and updates the cell. A promoted object of one cell has
+ * no room for the pending list link, so its cell is scanned right away.
+ */
+static void scancell(addr_t p) {
+  addr_t obj, q, v;
+
+  while (isstrong(p) && innursery(v = M(p))) {
+    obj = ptrobj(v);
+    if (gettag(obj) & SCRATCH_MASK) {
+      M(p) = M(obj) + (v - obj);
+      return;
+    }
+    q = copyobj(obj);
+    M(p) = q + (v - obj);
+    if (hascont(q)) return;
+    p = q;
+  }
+}
+
+/* Scans the cells of the object at p. */
+static void scanobj(addr_t p) {
+  for (; hascont(p); p += CELL_SZ) scancell(p);
+  scancell(p);
+}
+
+/* Returns the address p has after promotion, promoting its object. */
+static addr_t promote(addr_t p) {
+  addr_t obj = ptrobj(p);
+
+  if (!innursery(p)) return p;
+  if (!(gettag(obj) & SCRATCH_MASK) && !hascont(copyobj(obj))) {
+    scancell(M(obj));
+  }
+  return M(obj) + (p - obj);
+}
+
+/*
+ * Updates the weak references held by the object at p that point into
+ * the nursery, clearing those to objects that were not promoted.
+ */
+static void fixweak(addr_t p) {
+  addr_t v;
+
+  for (;; p += CELL_SZ) {
+    v = M(p);
+    if ((gettag(p) & WEAK_MASK) && innursery(v)) {
+      M(p) = gettag(v) & SCRATCH_MASK ? (addr_t) M(v) : ADDR_MASK;
+    }
+    if (!hascont(p)) return;
+  }
+}
+
+/**
+ * Records that the object at p, which is not in the nursery, is about
+ * to have an address in the nursery stored in it. The program must do
+ * this for every such store, including weak references.
+ *
+ * @return 0 on success, or -1 if the remembered set is full. The
+ *   program should then call gc_minor() before doing the store.
+ */
+int gc_remember(addr_t p) {
+  if (innursery(p)) return 0;
+  if (nremembered && remembered[nremembered - 1] == p) return 0;
+  if (nremembered == REMEMBERED_SIZE) return -1;
+  remembered[nremembered++] = p;
+  return 0;
+}
+
+/* Removes the object at p from the remembered set. */
+static void forget(addr_t p) {
+  size_t i;
+
+  for (i = 0; i < nremembered; ) {
+    if (remembered[i] == p) remembered[i] = remembered[--nremembered];
+    else ++i;
+  }
+}
+
+/*
+ * Called by gc_finish() before it reclaims memory. Removes the objects
+ * about to be reclaimed from the remembered set, and clears the weak
+ * references from the nursery to them.
+ */
+static void reclaimnursery() {
+  addr_t p;
+  size_t i;
+
+  for (i = 0; i < nremembered; ) {
+    if (isfree(remembered[i])) remembered[i] = remembered[--nremembered];
+    else ++i;
+  }
+  for (p = NURSERY_BASE; p < nurseryptr; p += CELL_SZ) clearweak(p);
+}
+
+/**
+ * Performs a minor collection: copies the objects in the nursery that
+ * are reachable from the shadow stack, the root table, the
+ * finalization table and queue and the remembered set to the main
+ * heap, updating the references to them, and empties the nursery.
+ * Must not be called between gc_begin() and gc_finish().
+ *
+ * @return 0 on success, or -1 if the largest free span in the main
+ *   heap could not hold the whole nursery, in which case nothing is
+ *   done.
+ */
+int gc_minor() {
+  addr_t end, p;
+  size_t i, largest = 0;
+
+  /* First fit always finds room for the survivors if one span can hold
+   * all of them. */
+  for (p = freeptr; p != ADDR_MASK; p = nextfree(p) & ADDR_MASK) {
+    if (freelen(p) > largest) largest = freelen(p);
+  }
+  if (largest * CELL_SZ < (size_t) (nurseryptr - NURSERY_BASE)) return -1;
+
+  promoting = 1;
+  maproots(promote);
+  for (i = 0; i < nremembered; ++i) scanobj(remembered[i]);
+  while (pending != ADDR_MASK) {
+    p = pending;
+    pending = M(p + CELL_SZ);
+    scanobj(M(p));
+  }
+  promoting = 0;
+
+  /* Weak references can only be updated once it is known which
+   * objects survived. */
+  for (i = 0; i < nremembered; ++i) fixweak(remembered[i]);
+  for (p = NURSERY_BASE; p < nurseryptr; p = end + CELL_SZ) {
+    for (end = p; hascont(end); end += CELL_SZ);
+    if (gettag(p) & SCRATCH_MASK) fixweak(M(p));
+  }
+
+  clearstarts(NURSERY_BASE, nurseryptr);
+  memset(mem + tagaddr(NURSERY_BASE), 0, (nurseryptr - NURSERY_BASE) / CELL_SZ);
+  nurseryptr = NURSERY_BASE;
+  nremembered = 0;
+  return 0;
+}
+#endif
+
+#ifdef IBGC_IMMIX
+/* Nonzero for the blocks gc_reclaim() is evacuating, and for those it
+ * keeps allocation out of while doing so. */
+uint8_t evacuating[NBLOCKS], reserved[NBLOCKS];
+
+static size_t block(addr_t p) { return p / LINE_BYTES / BLOCK_LINES; }
+
+/* Returns the new address of p, if the object it points into has moved. */
+static addr_t relocate(addr_t p) {
+  addr_t obj = ptrobj(p);
+
+  return gettag(obj) & SCRATCH_MASK ? M(obj) + (p - obj) : p;
+}
+
+/*
+ * Moves the live object from p up to end to a hole outside the blocks
+ * being evacuated. The new address is left in the object's first cell,
+ * which is tagged with SCRATCH_MASK. If there is no room, the object
+ * stays where it is, and its lines are marked again.
+ *
+ * @return nonzero if the object was moved.
+ */
+static int evacuate(addr_t p, addr_t end) {
+  addr_t n = (end - p) / CELL_SZ, q = alloc(n, gettag(p));
+
+  if (q == ADDR_MASK) {
+    setlines(linemarks, p, end);
+    return 0;
+  }
+  memcpy(mem + q, mem + p, end - p);
+  memcpy(mem + tagaddr(q), mem + tagaddr(p), n);
+  M(p) = q;
+  settag(p, gettag(p) | SCRATCH_MASK);
+  return 1;
+}
+
+/*
+ * After objects have been evacuated, updates the references to them,
+ * and turns the old copies into fillers.
+ */
+static void relocateall() {
+  addr_t end, p;
+  int moved;
+
+  for (p = ALLOC_BASE; p < alloc_top; p = end + CELL_SZ) {
+    moved = gettag(p) & SCRATCH_MASK;
+    for (end = p; ; end += CELL_SZ) {
+      if (!moved && isref(end)) M(end) = relocate(M(end));
+      if (!hascont(end)) break;
+    }
+  }
+  maproots(relocate);
+
+  for (p = ALLOC_BASE; p < alloc_top; p = end) {
+    for (end = p; hascont(end); end += CELL_SZ);
+    end += CELL_SZ;
+    if (gettag(p) & SCRATCH_MASK) freespan(p, end);
+  }
+}
+
+/**
+ * Clears weak references to unmarked objects, and turns them into
+ * fillers. The lines marked by the tracer become the lines in use.
+ * When gc_collect() allows it, the live objects in blocks with at most
+ * EVACUATE_LINES marked lines are moved into the holes of fuller
+ * blocks, where they fit, so that the sparse blocks become free.
+ */
+void gc_reclaim() {
+  addr_t end, p;
+  size_t b, n;
+  int moved = 0;
+
+  /* Choose the blocks to evacuate. Their objects are moved into the
+   * holes of fuller blocks, so allocation is kept out of both the
+   * blocks being evacuated and the free blocks until it is done. */
+  for (b = 0; b < NBLOCKS; ++b) {
+    n = popcount(linemarks[b]);
+    evacuating[b] = canmove && n && n <= EVACUATE_LINES;
+    reserved[b] = canmove && n <= EVACUATE_LINES;
+    lineused[b] = reserved[b] ? ~0UL : linemarks[b];
+    if (evacuating[b]) linemarks[b] = 0;
+  }
+  bumpptr = bumplimit = ADDR_MASK;
+  holeptr = ALLOC_BASE;
+
+  /* Fillers are marked, so weak references must be cleared before
+   * any of their targets become fillers. */
+  clearweakrefs();
+  for (p = ALLOC_BASE; p < alloc_top; p = end) {
+    if (!isfree(p)) {
+      for (end = p; hascont(end); end += CELL_SZ);
+      end += CELL_SZ;
+      if (block(end - CELL_SZ) != block(p)) {
+        /* Objects that cross blocks stay put, but the marks of their
+         * lines in any evacuated block were cleared above. */
+        setlines(linemarks, p, end);
+      } else if (evacuating[block(p)] && evacuate(p, end)) {
+        moved = 1;
+      }
+      continue;
+    }
+
+    /* Coalesce p with the unreachable objects that follow it. */
+    end = p;
+    do {
+      for (; hascont(end); end += CELL_SZ);
+      end += CELL_SZ;
+    } while (end < alloc_top && isfree(end));
+    freespan(p, end);
+  }
+
+  if (moved) relocateall();
+  for (b = 0; b < NBLOCKS; ++b) {
+    if (reserved[b]) lineused[b] = linemarks[b];
+  }
+}
+#elif defined(IBGC_TREADMILL)
+/**
+ * Frees the white objects left by a cycle, and clears the weak
+ * references black objects hold to them. This is the flip of the
+ * treadmill: the white lists are spliced onto the free lists, and the
+ * black lists become the white lists of the next cycle. Only objects
+ * holding weak references are visited.
+ */
+void gc_reclaim() {
+  addr_t p, q, weak;
+  unsigned c;
+
+  for (c = 0; c < TREADMILL_CLASSES; ++c) {
+    weak = TM_LIST(c, TM_WEAKBLACK);
+    for (p = TM_NEXT(weak); p != weak; p = TM_NEXT(p)) {
+      for (q = p; hascont(q); q += CELL_SZ) clearweak(q);
+      clearweak(q);
+    }
+    tmsplice(TM_LIST(c, TM_WHITE), TM_LIST(c, TM_FREE));
+    tmsplice(TM_LIST(c, TM_BLACK), TM_LIST(c, TM_WHITE));
+    tmsplice(weak, TM_LIST(c, TM_WHITE));
+    nfree[c] = nslots[c] - nmarked[c];
+    nmarked[c] = 0;
+  }
+}
+#else
+/* Puts the cells from p up to end, which follow the cells swept so
+ * far, on the end of the free list, coalescing them with the last span
+ * if it ends at p. */
+static void sweptspan(addr_t p, addr_t end) {
+  addr_t last = sweep.prev_free, len = (end - p) / CELL_SZ;
+
+  if (last != ADDR_MASK && last + freelen(last) * CELL_SZ == p) {
+    mkspan(last, ADDR_MASK, freelen(last) + len);
+    return;
+  }
+  mkspan(p, ADDR_MASK, len);
+  if (last == ADDR_MASK) freeptr = p;
+  else M(last) = p;
+  sweep.prev_free = p;
+}
+
+/*
+ * Sweeps on from sweep.p, stopping after about n cells, or once the
+ * last span on the free list has at least want cells. The free list
+ * is rebuilt in address order: the spans that were already free are
+ * taken over from the old list, and runs of unreachable objects
+ * become new spans, coalesced with the spans next to them.
+ *
+ * Returns nonzero if there is more to sweep.
+ */
+static int sweepcells(size_t n, addr_t want) {
+  addr_t end, p = sweep.p;
+  size_t k;
+
+  while (p < alloc_top) {
+    if (n == 0) {
+      sweep.p = p;
+      return 1;
+    }
+    if (p == sweep.next_free) {
+      /* Take the span over from the old list. */
+      end = p + freelen(p) * CELL_SZ;
+      sweep.next_free = nextfree(p);
+    } else if ((gettag(p) & MARK_MASK) != sweep.dead) {
+      /* p is reachable. Without IBGC_INCREMENTAL_SWEEP, clear the weak
+       * references it holds to unreachable objects. */
+#ifdef IBGC_INCREMENTAL_SWEEP
+      for (end = p; hascont(end); end += CELL_SZ);
+#else
+      for (end = p; hascont(end); end += CELL_SZ) clearweak(end);
+      clearweak(end);
+#endif
+      end += CELL_SZ;
+#ifdef IBGC_REFCOUNT
+      recount(p, end);
+#endif
+      k = (end - p) / CELL_SZ;
+      n = n > k ? n - k : 0;
+      p = end;
+      continue;
+    } else {
+      /* Determine where p ends. If p is followed by other unreachable
+       * objects, or by a free span, coalesce them. */
+      end = p;
+      do {
+        for (; hascont(end); end += CELL_SZ);
+        end += CELL_SZ;
+      } while (end != sweep.next_free && end < alloc_top &&
+               (gettag(end) & MARK_MASK) == sweep.dead);
+      clearstarts(p, end);
+      if (end == sweep.next_free) {
+        sweep.next_free = nextfree(end);
+        end += freelen(end) * CELL_SZ;
+      }
+    }
+    sweptspan(p, end);
+    k = (end - p) / CELL_SZ;
+    n = n > k ? n - k : 0;
+    p = end;
+    if (freelen(sweep.prev_free) >= want) break;
+  }
+  sweep.p = p < alloc_top ? p : ADDR_MASK;
+  return sweep.p != ADDR_MASK;
+}
+
+/* Starts a sweep from the bottom of memory, with an empty free list. */
+static void startsweep() {
+#ifdef IBGC_THREADS
+  retireall();
+#endif
+#ifdef IBGC_REFCOUNT
+  memset(refcounts, 0, sizeof(refcounts));
+  nzct = 0;
+#endif
+  sweep.p = ALLOC_BASE;
+  sweep.next_free = freeptr;
+  sweep.prev_free = ADDR_MASK;
+  sweep.dead = mark_tag ^ MARK_MASK;
+  freeptr = ADDR_MASK;
+}
+
+#ifdef IBGC_INCREMENTAL_SWEEP
+/**
+ * Clears weak references to unmarked objects, and starts a sweep that
+ * returns them to the free list. The free list is empty until
+ * gc_sweep() or alloc() sweep on: alloc() sweeps as far as it needs
+ * to find a large enough span. The sweep is finished before the next
+ * cycle starts.
+ */
+void gc_reclaim() {
+  clearweakrefs();
+  startsweep();
+}
+
+/**
+ * Sweeps up to about ncells cells. If us is not 0, also stops after
+ * about us microseconds, checking the clock every SWEEP_CHUNK cells.
+ * The free spans found are added to the free list right away.
+ *
+ * @return nonzero if there is more to sweep.
+ */
+int gc_sweep(size_t ncells, unsigned long us) {
+  struct timespec t0, t;
+  size_t n;
+
+  if (!us) return sweepcells(ncells, ADDR_MASK);
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  for (;;) {
+    n = ncells < SWEEP_CHUNK ? ncells : SWEEP_CHUNK;
+    ncells -= n;
+    if (!sweepcells(n, ADDR_MASK)) return 0;
+    if (!ncells) return 1;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    if ((unsigned long) ((t.tv_sec - t0.tv_sec) * 1000000L +
+                         (t.tv_nsec - t0.tv_nsec) / 1000) >= us) {
+      return 1;
+    }
+  }
+}
+
+/* Finishes the sweep in progress, if any. */
+static void finishsweep() {
+  sweepcells((size_t) -1, ADDR_MASK);
+}
+#else
+/**
+ * Return all unmarked objects to the free list, and clear weak
+ * references to them.
+ */
+void gc_reclaim() {
+  startsweep();
+  sweepcells((size_t) -1, ADDR_MASK);
+}
+#endif
+#endif
+
+/**
+ * Returns the object at p to the free list right away, instead of
+ * waiting for it to be found unreachable. The program must not use
+ * the object afterwards. Objects in regions are left for
+ * gc_region_release().
+ */
+void gc_free(addr_t p) {
+#ifndef IBGC_TREADMILL
+  addr_t end = p;
+#endif
+
+  /* Objects in regions are freed with their region. */
+  if (inregion(p)) return;
+#ifdef IBGC_NURSERY
+  /* The nursery is emptied by gc_minor(). */
+  if (innursery(p)) return;
+  forget(p);
+#endif
+#ifdef IBGC_REFCOUNT
+  dropzct(p);
+  REFCOUNT(p) = 0;
+#endif
+#ifdef IBGC_TREADMILL
+  if (!isfree(p)) --nmarked[slotclass(p)];
+  ++nfree[slotclass(p)];
+  tmmove(p, TM_FREE);
+#else
+  for (; hascont(end); end += CELL_SZ);
+  LOCK();
+  freespan(p, end + CELL_SZ);
+  UNLOCK();
+#endif
+}
+
+#ifdef IBGC_REFCOUNT
+/**
+ * Stores the address v, or ADDR_MASK, in the cell at p of an object,
+ * counting the reference it now holds instead of the one it held
+ * before. The pointer bit is set or cleared to match, unless the cell
+ * has the weak bit. With IBGC_REFCOUNT, all addresses stored in
+ * objects must be stored this way, including weak references.
+ */
+void gc_write(addr_t p, addr_t v) {
+  addr_t old = counted(p) ? (addr_t) M(p) : ADDR_MASK;
+
+  M(p) = v;
+  if (kind(p) == 0 && !(gettag(p) & WEAK_MASK)) {
+    settag(p, v == ADDR_MASK ? gettag(p) & ~PTR_MASK : gettag(p) | PTR_MASK);
+  }
+  if (v != ADDR_MASK) {
+    if (counted(p)) retain(v);
+    else if (uncounted(p)) stick(v);
+  }
+  if (old != ADDR_MASK) release(old);
+}
+
+#elif defined(IBGC_TREADMILL)
+/**
+ * Stores the address v, or ADDR_MASK, in the cell at p of an object.
+ * The pointer bit is set or cleared to match, unless the cell has the
+ * weak bit. While a cycle is in progress, the objects the cell pointed
+ * to and now points to are shaded, so that everything reachable when
+ * the cycle started is kept (a snapshot-at-the-beginning barrier), even
+ * if it was only reachable through a weak reference, and an object that
+ * has been scanned and gets a weak reference is remembered, so that
+ * the reference is cleared if the object it refers to dies. With IBGC_TREADMILL, all
+ * addresses stored in objects must be stored this way.
+ */
+void gc_write(addr_t p, addr_t v) {
+  addr_t obj;
+
+  if (gc_phase != GC_IDLE && (addr_t) M(p) != ADDR_MASK &&
+      (isptr(p) || kind(p) == KIND_EPHEMERON)) {
+    shade(M(p));
+  }
+  M(p) = v;
+  if (!(gettag(p) & WEAK_MASK)) {
+    if (kind(p) == 0) {
+      settag(p, v == ADDR_MASK ? gettag(p) & ~PTR_MASK : gettag(p) | PTR_MASK);
+    }
+  } else if (gc_phase != GC_IDLE && v != ADDR_MASK) {
+    obj = objstart(p);
+    if (!isfree(obj) && !(gettag(obj) & SCRATCH_MASK)) {
+      tmmove(obj, TM_WEAKBLACK);
+    }
+  }
+  if (gc_phase != GC_IDLE && v != ADDR_MASK &&
+      (isptr(p) || kind(p) == KIND_EPHEMERON)) {
+    shade(v);
+  }
+}
+#endif
+
+#ifdef IBGC_REFCOUNT
+/* Sets or clears RC_PINNED for the objects the n addresses at a point
+ * into. */
+static void pinarray(addr_t *a, size_t n, int pin) {
+  for (; n; --n, ++a) {
+    if (*a == ADDR_MASK) continue;
+    if (pin) REFCOUNT(ptrobj(*a)) |= RC_PINNED;
+    else REFCOUNT(ptrobj(*a)) &= ~RC_PINNED;
+  }
+}
+
+/* Sets or clears RC_PINNED for the objects the roots point into. */
+static void pinroots(int pin) {
+  size_t i;
+
+  pinarray(shadow_stack, shadow_top, pin);
+  for (i = 0; i < nroots; ++i) pinarray(root_table[i], 1, pin);
+  pinarray(final_table, nfinal, pin);
+  pinarray(final_queue, nqueued, pin);
+}
+
+/**
+ * Frees the objects in the zero count table that the roots do not
+ * point to, and then the objects whose count drops to 0 because of
+ * that. The roots are the shadow stack, the root table and the
+ * finalization table and queue, so any address the program holds
+ * elsewhere must also be on one of them. Objects the roots point to
+ * stay in the table. Must not be called between gc_begin() and
+ * gc_finish().
+ *
+ * @return the number of objects freed.
+ */
+size_t gc_drain_zct() {
+  addr_t end, p;
+  size_t i, kept = 0, n = 0;
+
+  pinroots(1);
+  /* Freeing an object can add more objects to the table, after i. */
+  for (i = 0; i < nzct; ++i) {
+    p = zct[i];
+    if (REFCOUNT(p) & RC_PINNED) {
+      zct[kept++] = p;
+      continue;
+    }
+    REFCOUNT(p) &= ~RC_INZCT;
+    /* Referenced again, or freed with its region. */
+    if (REFCOUNT(p) || inregion(p)) continue;
+    for (end = p; ; end += CELL_SZ) {
+      if (counted(end)) release(M(end));
+      if (!hascont(end)) break;
+    }
+    freespan(p, end + CELL_SZ);
+    ++n;
+  }
+  nzct = kept;
+  pinroots(0);
+  return n;
+}
+#endif
+
+/**
+ * Sets the tag bits selected by mask to the corresponding bits in bits
+ * for the n cells starting at p. mask may only contain bits in
+ * CELL_BITS. The tags are updated a word at a time, which makes this
+ * much cheaper than setting the tags one by one.
+ */
+void gc_settags(addr_t p, addr_t n, uint8_t mask, uint8_t bits) {
+  char *t = mem + tagaddr(p), *end = mem + tagaddr(p + n * CELL_SZ);
+  unsigned long w, wmask = TAGWORD(mask), wbits = TAGWORD(bits & mask);
+
+  bits &= mask;
+  for (; t != end && (uintptr_t) t % sizeof(long); ++t) {
+    *t = (*t & ~mask) | bits;
+  }
+  for (; end - t >= (ptrdiff_t) sizeof(long); t += sizeof(long)) {
+    memcpy(&w, t, sizeof(long));
+    w = (w & ~wmask) | wbits;
+    memcpy(t, &w, sizeof(long));
+  }
+  for (; t != end; ++t) *t = (*t & ~mask) | bits;
+}
+
+/**
+ * Copies n cells from src to dst, together with the CELL_BITS of their
+ * tags. The source and destination may overlap. With IBGC_TREADMILL,
+ * a black destination object is made gray again, so that what the
+ * copied cells point to is marked.
+ */
+void gc_copy(addr_t dst, addr_t src, addr_t n) {
+  char *d = mem + tagaddr(dst), *s = mem + tagaddr(src);
+  size_t i, len = tagaddr(src + n * CELL_SZ) - tagaddr(src);
+  unsigned long a, b, wmask = TAGWORD(CELL_BITS);
+
+  memmove(mem + dst, mem + src, n * CELL_SZ);
+
+  /* Merge the tags a word at a time, in the direction that does not
+   * overwrite source tags before they have been read. */
+  if (d < s) {
+    for (i = 0; len - i >= sizeof(long); i += sizeof(long)) {
+      memcpy(&a, s + i, sizeof(long));
+      memcpy(&b, d + i, sizeof(long));
+      b = (b & ~wmask) | (a & wmask);
+      memcpy(d + i, &b, sizeof(long));
+    }
+    for (; i < len; ++i) d[i] = (d[i] & ~CELL_BITS) | (s[i] & CELL_BITS);
+  } else {
+    for (i = len; i >= sizeof(long); i -= sizeof(long)) {
+      memcpy(&a, s + i - sizeof(long), sizeof(long));
+      memcpy(&b, d + i - sizeof(long), sizeof(long));
+      b = (b & ~wmask) | (a & wmask);
+      memcpy(d + i - sizeof(long), &b, sizeof(long));
+    }
+    for (; i > 0; --i) {
+      d[i - 1] = (d[i - 1] & ~CELL_BITS) | (s[i - 1] & CELL_BITS);
+    }
+  }
+#ifdef IBGC_TREADMILL
+  dst = objstart(dst);
+  if (gc_phase != GC_IDLE && !isfree(dst) && !(gettag(dst) & SCRATCH_MASK)) {
+    gray(dst);
+  }
+#endif
+}
+
+/**
+ * Changes the size of the object at p to ncells cells. Shrinking
+ * returns the cells after the new end to the free list. Growing
+ * takes cells from the free span directly after the object, if there
+ * is one that is large enough. Otherwise, a new object is allocated,
+ * the cells and their pointer and info bits are copied to it, and the
+ * old object is freed. Objects in regions are only shrunk in place;
+ * when they grow, the new object is allocated outside the region.
+ * With IBGC_TREADMILL, objects shrink and grow within their slot, and
+ * are only moved when they outgrow it.
+ *
+ * @return the address of the resized object (p, unless it had to be
+ *   moved), or ADDR_MASK if there was not enough memory, in which
+ *   case the object is left unchanged.
+ */
+addr_t gc_resize(addr_t p, addr_t ncells) {
+  addr_t end = p, len, next;
+#if !defined(IBGC_IMMIX) && !defined(IBGC_TREADMILL)
+  addr_t prev = ADDR_MASK;
+#endif
+
+  for (; hascont(end); end += CELL_SZ);
+  end += CELL_SZ;
+  len = (end - p) / CELL_SZ;
+
+#ifdef IBGC_TREADMILL
+  if (ncells <= 1UL << slotclass(p)) {
+    next = p + ncells * CELL_SZ;
+    if (ncells < len) {
+      settag(next - CELL_SZ, gettag(next - CELL_SZ) & ~CONT_MASK);
+    } else if (ncells > len) {
+      settag(end - CELL_SZ, gettag(end - CELL_SZ) | CONT_MASK);
+      conttags(end, next, kind(p));
+      if (kind(p) == KIND_PTRS) clearcells(end, next);
+    }
+    return p;
+  }
+#else
+  if (ncells <= len) {
+    if (ncells < len) {
+      next = p + ncells * CELL_SZ;
+      settag(next - CELL_SZ, gettag(next - CELL_SZ) & ~CONT_MASK);
+#ifdef IBGC_REGIONS
+      /* The cells cut off an object in a region stay in the region. */
+      if (inregion(p)) {
+        rawfill(next, end);
+        return p;
+      }
+#endif
+      LOCK();
+#ifdef IBGC_NURSERY
+      if (!innursery(p))
+#endif
+      freespan(next, end);
+      UNLOCK();
+    }
+    return p;
+  }
+
+#ifndef IBGC_IMMIX
+  /* Grow in place if the object is followed by a large enough span. */
+  LOCK();
+  for (next = freeptr; next < end; next = nextfree(next) & ADDR_MASK) {
+    prev = next;
+  }
+  if (next == end && freelen(next) >= ncells - len && !inregion(p)) {
+    takespan(prev, next, freelen(next), ncells - len);
+    UNLOCK();
+    settag(end - CELL_SZ, gettag(end - CELL_SZ) | CONT_MASK);
+    conttags(end, p + ncells * CELL_SZ, kind(p));
+    if (kind(p) == KIND_PTRS) clearcells(end, p + ncells * CELL_SZ);
+    return p;
+  }
+  UNLOCK();
+#endif
+#endif
+
+  /* Move the object. */
+  next = alloc(ncells, gettag(p));
+  if (next == ADDR_MASK) return next;
+#ifdef IBGC_NURSERY
+  /* The copy may hold addresses in the nursery. */
+  if (gc_remember(next)) {
+    gc_free(next);
+    return ADDR_MASK;
+  }
+#endif
+  gc_copy(next, p, len);
+  gc_free(p);
+  return next;
+}
+
+#ifdef IBGC_REGIONS
+/**
+ * Opens a region of ncells cells, taken from the free list.
+ *
+ * @return the number of the region, or -1 if MAX_REGIONS regions are
+ *   open or there is no free span of ncells cells.
+ */
+int gc_region_open(addr_t ncells) {
+  addr_t p = ADDR_MASK;
+  int r;
+
+  LOCK();
+  for (r = 0; r < MAX_REGIONS && regions[r].base != ADDR_MASK; ++r);
+  if (r < MAX_REGIONS && ncells) p = lockedcells(ncells);
+  if (p != ADDR_MASK) {
+    regions[r].base = regions[r].ptr = p;
+    regions[r].limit = p + ncells * CELL_SZ;
+    rawfill(p, regions[r].limit);
+  }
+  UNLOCK();
+  return p == ADDR_MASK ? -1 : r;
+}
+
+/**
+ * Allocates ncells cells in region r, like alloc(). The object lives
+ * until the region is released. Only one thread may allocate in a
+ * region.
+ *
+ * @return the address of the first cell, or ADDR_MASK if the region
+ *   does not have ncells cells left.
+ */
+addr_t gc_region_alloc(int r, addr_t ncells, uint8_t tag) {
+  struct region *g = &regions[r];
+  addr_t p = g->ptr;
+
+  if (!ncells || (size_t) (g->limit - p) < ncells * CELL_SZ) return ADDR_MASK;
+  g->ptr += ncells * CELL_SZ;
+  if (g->ptr != g->limit) rawhead(g->ptr, g->limit);
+  initobj(p, ncells, tag);
+  return p;
+}
+
+/* Returns nonzero if the cell at p refers to a cell from base up to
+ * limit. */
+static int refersto(addr_t p, addr_t base, addr_t limit) {
+  return isref(p) && (addr_t) M(p) >= base && (addr_t) M(p) < limit;
+}
+
+/* Returns the number of the n addresses at a that are from base up to
+ * limit. */
+static size_t countin(addr_t *a, size_t n, addr_t base, addr_t limit) {
+  size_t k = 0;
+
+  for (; n; --n, ++a) if (*a >= base && *a < limit) ++k;
+  return k;
+}
+
+/**
+ * Returns the number of references into region r from outside it:
+ * from the cells of other objects, including unreachable ones that
+ * have not been collected yet, and from the shadow stack, the root
+ * table, the finalization table and queue and the roots registered by
+ * threads. This visits all of memory, and is meant for debugging. Must
+ * not be called between gc_begin() and gc_finish(), or while other
+ * threads allocate.
+ */
+size_t gc_region_escapes(int r) {
+  addr_t base = regions[r].base, limit = regions[r].limit, next_free, p;
+  size_t i, n = 0;
+
+#ifdef IBGC_THREADS
+  retireall();
+#endif
+#ifdef IBGC_INCREMENTAL_SWEEP
+  finishsweep();
+#endif
+  for (p = ALLOC_BASE, next_free = freeptr; p < alloc_top; p += CELL_SZ) {
+    if (p == next_free) {
+      next_free = nextfree(p);
+      p += (freelen(p) - 1) * CELL_SZ;
+    } else if (p == base) {
+      p = limit - CELL_SZ;
+    } else if (refersto(p, base, limit)) {
+      ++n;
+    }
+  }
+#ifdef IBGC_NURSERY
+  for (p = NURSERY_BASE; p < nurseryptr; p += CELL_SZ) {
+    if (refersto(p, base, limit)) ++n;
+  }
+#endif
+
+  n += countin(shadow_stack, shadow_top, base, limit);
+  for (i = 0; i < nroots; ++i) n += countin(root_table[i], 1, base, limit);
+#ifdef IBGC_THREADS
+  for (i = 0; i < MAX_THREADS; ++i) {
+    if (tlabs[i].used && tlabs[i].stack) {
+      n += countin(tlabs[i].stack, *tlabs[i].top, base, limit);
+    }
+  }
+#endif
+  n += countin(final_table, nfinal, base, limit);
+  n += countin(final_queue, nqueued, base, limit);
+  return n;
+}
+
+#if defined(IBGC_NURSERY) || defined(IBGC_REFCOUNT)
+/* Removes the addresses from base up to limit from the *n addresses
+ * at a. */
+static void droprange(addr_t *a, size_t *n, addr_t base, addr_t limit) {
+  size_t i;
+
+  for (i = 0; i < *n; ) {
+    if (a[i] >= base && a[i] < limit) a[i] = a[--*n];
+    else ++i;
+  }
+}
+#endif
+
+/**
+ * Releases region r: all of its cells go back to the free list in one
+ * span, without visiting its objects. References to them that the
+ * program still holds become invalid. With IBGC_REGION_CHECK, the
+ * region is only released if gc_region_escapes() finds no references
+ * into it.
+ *
+ * @return 0 on success, or -1 if references escape the region.
+ */
+int gc_region_release(int r) {
+  addr_t base = regions[r].base, limit = regions[r].limit;
+
+#ifdef IBGC_REGION_CHECK
+  if (gc_region_escapes(r)) return -1;
+#endif
+#ifdef IBGC_INCREMENTAL_SWEEP
+  /* freespan() leaves cells at or after sweep.p to the sweep, one
+   * object at a time, but the region may straddle it. */
+  finishsweep();
+#endif
+#ifdef IBGC_NURSERY
+  droprange(remembered, &nremembered, base, limit);
+#endif
+#ifdef IBGC_REFCOUNT
+  droprange(zct, &nzct, base, limit);
+  memset(&REFCOUNT(base), 0, (limit - base) / CELL_SZ);
+#endif
+  LOCK();
+  regions[r].base = ADDR_MASK;
+  freespan(base, limit);
+  UNLOCK();
+  return 0;
+}
+
+/* Marks the objects in the open regions, and everything they point
+ * to, and the unused rest of each region. */
+static void traceregions() {
+  addr_t p;
+  size_t i;
+
+  for (i = 0; i < MAX_REGIONS; ++i) {
+    if (regions[i].base == ADDR_MASK) continue;
+    for (p = regions[i].base; p != regions[i].ptr; p += CELL_SZ) {
+      gc_trace(p);
+      while (hascont(p)) p += CELL_SZ;
+    }
+    if (p != regions[i].limit) mark(p);
+  }
+}
+#endif
+
+#ifdef IBGC_COMPACT
+/*
+ * Sliding compaction. livecells has one bit per cell, which is set for
+ * the cells of objects that are not free. liveoffsets holds the number
+ * of live cells before each word of livecells. Objects keep their
+ * order, so the address a cell moves to follows from the number of
+ * live cells before it.
+ */
+unsigned long livecells[MEM_BYTES / CELL_SZ / LONG_BITS + 1];
+addr_t liveoffsets[MEM_BYTES / CELL_SZ / LONG_BITS + 1];
+
+/* Returns the address the live cell at p moves to. */
+static addr_t forward(addr_t p) {
+  size_t i = p / CELL_SZ;
+
+  return ALLOC_BASE + CELL_SZ * (liveoffsets[i / LONG_BITS] +
+    popcount(livecells[i / LONG_BITS] & ((1UL << (i % LONG_BITS)) - 1)));
+}
+
+/**
+ * Returns the fragmentation index of free memory: the percentage of
+ * free cells that are not part of the largest free span. During an
+ * incremental sweep, only the memory swept so far is counted.
+ */
+unsigned gc_fragmentation() {
+  addr_t p;
+  size_t len, total = 0, largest = 0;
+
+  for (p = freeptr; p != ADDR_MASK; p = nextfree(p) & ADDR_MASK) {
+    len = freelen(p);
+    total += len;
+    if (len > largest) largest = len;
+  }
+  return total ? 100 - largest * 100 / total : 0;
+}
+
+/**
+ * Slides all objects that are not free down to the start of memory,
+ * keeping their order, so that all free memory forms a single span at
+ * the top. References held in objects, on the shadow stack, in the
+ * root table and in the finalization table and queue are updated.
+ * Any other addresses the program holds become invalid. Must not be
+ * called between gc_begin() and gc_finish(). A sweep in progress is
+ * finished first. With IBGC_NURSERY, the nursery is emptied with
+ * gc_minor() first, since references from and into it are not
+ * updated; if that fails, the heap is not compacted.
+ */
+void gc_compact() {
+  addr_t end, p, q, next_free;
+  size_t i, n = 0;
+
+#ifdef IBGC_NURSERY
+  if (nurseryptr != NURSERY_BASE && gc_minor()) return;
+#endif
+#ifdef IBGC_THREADS
+  retireall();
+#endif
+#ifdef IBGC_INCREMENTAL_SWEEP
+  finishsweep();
+#endif
+
+  /* Everything that is not on the free list is live. */
+  memset(livecells, 0, sizeof(livecells));
+  for (p = ALLOC_BASE, next_free = freeptr; p < alloc_top; p = end) {
+    if (p == next_free) {
+      next_free = nextfree(p);
+      end = p + freelen(p) * CELL_SZ;
+      continue;
+    }
+    end = next_free < alloc_top ? next_free : alloc_top;
+    for (q = p; q != end; q += CELL_SZ) {
+      livecells[q / CELL_SZ / LONG_BITS] |= 1UL << (q / CELL_SZ % LONG_BITS);
+    }
+  }
+  for (i = 0; i < sizeof(livecells) / sizeof(*livecells); ++i) {
+    liveoffsets[i] = n;
+    n += popcount(livecells[i]);
+  }
+
+  /* Update references while the objects are still in place. */
+  for (p = ALLOC_BASE; p < alloc_top; p += CELL_SZ) {
+    i = p / CELL_SZ;
+    if (((livecells[i / LONG_BITS] >> (i % LONG_BITS)) & 1) && isref(p)) {
+      M(p) = forward(M(p));
+    }
+  }
+  maproots(forward);
+#ifdef IBGC_REGIONS
+  for (i = 0; i < MAX_REGIONS; ++i) {
+    if (regions[i].base == ADDR_MASK) continue;
+    regions[i].base = forward(regions[i].base);
+    regions[i].ptr = forward(regions[i].ptr);
+    regions[i].limit = forward(regions[i].limit);
+  }
+#endif
+
+  /* Slide each run of live cells down, along with its tags. */
+  for (p = ALLOC_BASE, q = ALLOC_BASE, next_free = freeptr; p < alloc_top; p = end) {
+    if (p == next_free) {
+      next_free = nextfree(p);
+      end = p + freelen(p) * CELL_SZ;
+      continue;
+    }
+    end = next_free < alloc_top ? next_free : alloc_top;
+    memmove(mem + q, mem + p, end - p);
+    memmove(mem + tagaddr(q), mem + tagaddr(p), (end - p) / CELL_SZ);
+#ifdef IBGC_REFCOUNT
+    memmove(&REFCOUNT(q), &REFCOUNT(p), (end - p) / CELL_SZ);
+#endif
+    q += end - p;
+  }
+#ifdef IBGC_REFCOUNT
+  memset(&REFCOUNT(q), 0, (alloc_top - q) / CELL_SZ);
+#endif
+
+#ifdef IBGC_INTERIOR
+  memset(objstarts, 0, sizeof(objstarts));
+  for (p = ALLOC_BASE; p < q; p += CELL_SZ) {
+    setstart(p);
+    while (hascont(p)) p += CELL_SZ;
+  }
+#endif
+
+  /* Make the rest of memory one free span. */
+  if (q == alloc_top) {
+    freeptr = ADDR_MASK;
+    return;
+  }
+  freeptr = q;
+  settag(q, mark_tag ^ MARK_MASK);
+  mkspan(q, ADDR_MASK, (alloc_top - q) / CELL_SZ);
+  settag(alloc_top - CELL_SZ, gettag(alloc_top - CELL_SZ) & ~CONT_MASK);
+}
+#endif
+
+/**
+ * Starts a collection cycle. After this, call gc_trace() for each of
+ * the roots, then gc_finish(). A sweep left by the previous cycle is
+ * finished first.
+ *
+ * Objects allocated before gc_finish() is called are considered
+ * reachable for this cycle. Their cells are not traced, so anything
+ * they point to must also be reachable from one of the roots.
+ */
+void gc_begin() {
+#ifdef IBGC_INCREMENTAL_SWEEP
+  finishsweep();
+#endif
+  gc_phase = GC_MARKING;
+#ifdef IBGC_IMMIX
+  memset(linemarks, 0, sizeof(linemarks));
+#endif
+}
+
+/**
+ * Finishes the collection cycle started by gc_begin(): resolves
+ * ephemerons, queues unreachable objects registered for
+ * finalization, returns other
+ * unreachable objects to the free list and flips the meaning of the
+ * mark bit, so that all objects start the next cycle unmarked.
+ */
+void gc_finish() {
+#ifdef IBGC_TREADMILL
+  /* Finish marking from the objects shaded so far. */
+  scan((size_t) -1);
+  stepping = 0;
+#endif
+#ifdef IBGC_REGIONS
+  traceregions();
+#endif
+  traceephemerons();
+  finalize();
+  traceephemerons();
+  clearephemerons();
+#ifdef IBGC_NURSERY
+  reclaimnursery();
+#endif
+  gc_reclaim();
+  mark_tag ^= MARK_MASK;
+  gc_phase = GC_IDLE;
+}
+
+/**
+ * Performs a complete collection cycle, using the shadow stack and the
+ * root table as roots. In conservative mode, the native stack is also
+ * scanned, if gc_stack_base has been set. Unless the native stack was
+ * scanned, objects may be moved: with IBGC_IMMIX, sparse blocks are
+ * evacuated, and with IBGC_COMPACT, the heap is compacted if the
+ * fragmentation index exceeds COMPACT_THRESHOLD. With
+ * IBGC_INCREMENTAL_SWEEP, the sweep is left to gc_sweep() and alloc()
+ * instead, and the heap is not compacted. With IBGC_NURSERY,
+ * a minor collection empties the nursery first. With IBGC_THREADS,
+ * the other attached threads are stopped at safepoints, and their
+ * registered roots are traced too. Only the native stack of the
+ * calling thread is scanned.
+ */
+void gc_collect() {
+#ifdef IBGC_NURSERY
+  int minor = gc_minor();
+
+#endif
+#ifdef IBGC_THREADS
+  gc_stop_world();
+#endif
+  gc_begin();
+  canmove = 1;
+  gc_trace_registered();
+#ifdef IBGC_CONSERVATIVE
+  if (gc_stack_base) gc_trace_stack();
+#endif
+  gc_finish();
+#ifdef IBGC_NURSERY
+  /* Try again now that memory has been freed. Only compact once the
+   * nursery is empty. */
+  if (minor && gc_minor()) canmove = 0;
+#endif
+#if defined(IBGC_COMPACT) && !defined(IBGC_INCREMENTAL_SWEEP)
+  if (canmove && gc_fragmentation() > COMPACT_THRESHOLD) gc_compact();
+#endif
+  canmove = 0;
+#ifdef IBGC_THREADS
+  gc_start_world();
+#endif
+}
+
+#ifdef IBGC_TREADMILL
+/**
+ * Does up to about n cells of collection work. If no cycle is in
+ * progress, starts one, shading the objects the shadow stack and the
+ * root table point to. Scans gray objects, and finishes the cycle with
+ * gc_finish() once none are left. alloc() calls this with
+ * TREADMILL_QUANTUM while a cycle is in progress, so the roots must be
+ * registered whenever the program allocates. Does nothing during a
+ * cycle started with gc_begin().
+ *
+ * @return nonzero if the cycle is still in progress.
+ */
+int gc_step(size_t n) {
+  size_t i;
+
+  if (gc_phase == GC_IDLE) {
+    gc_begin();
+    stepping = 1;
+    for (i = 0; i < shadow_top; ++i) {
+      if (shadow_stack[i] != ADDR_MASK) shade(shadow_stack[i]);
+    }
+    for (i = 0; i < nroots; ++i) {
+      if (*root_table[i] != ADDR_MASK) shade(*root_table[i]);
+    }
+  } else if (!stepping) {
+    return 1;
+  }
+  if (scan(n)) return 1;
+  gc_finish();
+  return 0;
+}
+#endif
+
+void ibgc_init() {
+#if defined(IBGC_REGIONS) || defined(IBGC_TREADMILL)
+  size_t i;
+
+#endif
+#ifdef IBGC_THREADS
+  dropbuffers();
+#endif
+#ifdef IBGC_INTERIOR
+  memset(objstarts, 0, sizeof(objstarts));
+#endif
+#ifdef IBGC_REFCOUNT
+  memset(refcounts, 0, sizeof(refcounts));
+  nzct = 0;
+#endif
+#ifdef IBGC_REGIONS
+  for (i = 0; i < MAX_REGIONS; ++i) regions[i].base = ADDR_MASK;
+#endif
+#ifdef IBGC_IMMIX
+  memset(lineused, 0, sizeof(lineused));
+  bumpptr = bumplimit = freeptr = ADDR_MASK;
+  holeptr = ALLOC_BASE;
+  fill(ALLOC_BASE, alloc_top);
+#elif defined(IBGC_TREADMILL)
+  for (i = 0; i < TM_SENTINELS; ++i) {
+    TM_NEXT(TM_SENTINEL(i)) = TM_PREV(TM_SENTINEL(i)) = TM_SENTINEL(i);
+  }
+  nextpage = TM_PAGES;
+  freeptr = ADDR_MASK;
+  stepping = 0;
+  memset(nslots, 0, sizeof(nslots));
+  memset(nfree, 0, sizeof(nfree));
+  memset(nmarked, 0, sizeof(nmarked));
+#else
+#ifdef IBGC_NURSERY
+  nurseryptr = NURSERY_BASE;
+  nremembered = 0;
+#endif
+#ifdef IBGC_INCREMENTAL_SWEEP
+  sweep.p = ADDR_MASK;
+#endif
+  unmark(freeptr);
+  mkspan(freeptr, ADDR_MASK, (alloc_top - ALLOC_BASE) / CELL_SZ);
+#endif
+}
+
+#ifdef IBGC_IMAGE
+/*
+ * Heap images. An image consists of a header, the collector state
+ * listed in imagestate, each part preceded by its size, padding up to
+ * the next multiple of IMAGE_ALIGN, and memory, including the tags,
+ * which starts at mem_offset. Addresses are offsets into memory, so an
+ * image stays valid wherever memory is. The sizes of the parts that
+ * cover memory depend on MEM_BYTES.
+ */
+struct imageheader {
+  char magic[4];
+  uint8_t cell_sz, addr_sz;
+  uint16_t nstate;
+  uint32_t mem_bytes, mem_offset;
+};
+
+static const struct { void *p; size_t n; } imagestate[] = {
+  { &freeptr, sizeof(freeptr) },
+  { &alloc_top, sizeof(alloc_top) },
+  { &mark_tag, sizeof(mark_tag) },
+#ifdef IBGC_INTERIOR
+  { objstarts, sizeof(objstarts) },
+#endif
+#ifdef IBGC_IMMIX
+  { lineused, sizeof(lineused) },
+  { &bumpptr, sizeof(bumpptr) },
+  { &bumplimit, sizeof(bumplimit) },
+  { &holeptr, sizeof(holeptr) },
+#endif
+#ifdef IBGC_NURSERY
+  { &nurseryptr, sizeof(nurseryptr) },
+  { remembered, sizeof(remembered) },
+  { &nremembered, sizeof(nremembered) },
+#endif
+#ifdef IBGC_REFCOUNT
+  { zct, sizeof(zct) },
+  { &nzct, sizeof(nzct) },
+  { refcounts, sizeof(refcounts) },
+#endif
+#ifdef IBGC_REGIONS
+  { regions, sizeof(regions) },
+#endif
+};
+
+#define NIMAGESTATE (sizeof(imagestate) / sizeof(*imagestate))
+
+/* Nonzero if memory was mapped from the image last loaded, rather
+ * than read. */
+static int imagemapped = 0;
+
+/**
+ * Writes memory and the collector state to the file at path. The
+ * roots and the finalization table and queue are not saved. Must not
+ * be called between gc_begin() and gc_finish().
+ *
+ * @return 0 on success, or -1 if the file could not be written.
+ */
+int ibgc_save_image(const char *path) {
+  struct imageheader h;
+  FILE *f = fopen(path, "wb");
+  uint32_t n;
+  size_t i, size = sizeof(h);
+  int ok;
+
+  if (!f) return -1;
+#ifdef IBGC_THREADS
+  retireall();
+#endif
+#ifdef IBGC_INCREMENTAL_SWEEP
+  finishsweep();
+#endif
+  memset(&h, 0, sizeof(h));
+  memcpy(h.magic, "IBGC", 4);
+  h.cell_sz = CELL_SZ;
+  h.addr_sz = sizeof(addr_t);
+  h.nstate = NIMAGESTATE;
+  h.mem_bytes = MEM_BYTES;
+  for (i = 0; i < NIMAGESTATE; ++i) size += sizeof(n) + imagestate[i].n;
+  h.mem_offset = (size + IMAGE_ALIGN - 1) / IMAGE_ALIGN * IMAGE_ALIGN;
+  ok = fwrite(&h, sizeof(h), 1, f) == 1;
+  for (i = 0; ok && i < NIMAGESTATE; ++i) {
+    n = imagestate[i].n;
+    ok = fwrite(&n, sizeof(n), 1, f) == 1 &&
+      fwrite(imagestate[i].p, n, 1, f) == 1;
+  }
+  ok = ok && fseek(f, h.mem_offset, SEEK_SET) == 0 &&
+    fwrite(mem, MEM_BYTES, 1, f) == 1;
+  if (fclose(f) != 0) ok = 0;
+  return ok ? 0 : -1;
+}
+
+#ifdef IMAGE_MMAP
+/*
+ * Maps the n bytes of memory in the image in f, which start at offset,
+ * copy-on-write over the start of memory. Returns nonzero on success,
+ * or 0 if they are not page aligned or mapping failed.
+ */
+static int mapimage(FILE *f, long offset, size_t n) {
+  long page = sysconf(_SC_PAGESIZE);
+
+  if (page <= 0 || offset % page || n % page) return 0;
+  if ((uintptr_t) mem % page) return 0;
+  return mmap(mem, n, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED,
+              fileno(f), offset) != MAP_FAILED;
+}
+#endif
+
+/*
+ * Finishes loading an image of a smaller memory of oldmem bytes, which
+ * has been read or mapped into the start of memory. The cells stay
+ * where they are, but the tags are moved to TAG_BASE in one go, and
+ * the cells from the top of the image's heap up to HEAP_TOP are freed.
+ * With IBGC_NURSERY, the image's nursery must be empty. Returns
+ * nonzero on success.
+ */
+static int growimage(size_t oldmem) {
+  addr_t top = alloc_top, oldtags = (oldmem >> 2) * 3;
+
+#ifdef IBGC_NURSERY
+  if (nurseryptr != top || nremembered) return 0;
+  nurseryptr = NURSERY_BASE;
+#endif
+  memmove(mem + TAG_BASE, mem + oldtags, oldtags >> 2);
+  alloc_top = HEAP_TOP;
+  memset(mem + tagaddr(top), 0, (alloc_top - top) / CELL_SZ);
+  freespan(top, alloc_top);
+  return 1;
+}
+
+/**
+ * Replaces memory and the collector state with the image saved by
+ * ibgc_save_image() at path, which must have been written by a build
+ * with the same configuration, apart from a MEM_BYTES that may be
+ * smaller. Memory beyond that of the image is added to the heap as
+ * free memory. Where possible, memory is mapped copy-on-write rather
+ * than read, so that loading is immediate and processes that load
+ * the same image share the pages they do not modify. Call this
+ * instead of ibgc_init(), then register the roots.
+ *
+ * @return 0 on success, or -1 if the file could not be read or does
+ *   not hold a matching image, in which case the collector state may
+ *   have been overwritten.
+ */
+int ibgc_load_image(const char *path) {
+  struct imageheader h;
+  FILE *f = fopen(path, "rb");
+  uint32_t n;
+  size_t i;
+  int ok;
+
+  imagemapped = 0;
+  if (!f) return -1;
+  ok = fread(&h, sizeof(h), 1, f) == 1 && !memcmp(h.magic, "IBGC", 4) &&
+    h.cell_sz == CELL_SZ && h.addr_sz == sizeof(addr_t) &&
+    h.nstate == NIMAGESTATE && h.mem_bytes <= MEM_BYTES &&
+    h.mem_offset % IMAGE_ALIGN == 0;
+  for (i = 0; ok && i < NIMAGESTATE; ++i) {
+    /* Parts that cover memory are shorter in a smaller image. */
+    memset(imagestate[i].p, 0, imagestate[i].n);
+    ok = fread(&n, sizeof(n), 1, f) == 1 && n <= imagestate[i].n &&
+      fread(imagestate[i].p, n, 1, f) == 1;
+  }
+  ok = ok && ftell(f) <= (long) h.mem_offset && fseek(f, 0, SEEK_END) == 0 &&
+    ftell(f) == (long) h.mem_offset + (long) h.mem_bytes;
+#ifdef IMAGE_MMAP
+  imagemapped = ok && mapimage(f, h.mem_offset, h.mem_bytes);
+#endif
+  if (!imagemapped) {
+    ok = ok && fseek(f, h.mem_offset, SEEK_SET) == 0 &&
+      fread(mem, h.mem_bytes, 1, f) == 1;
+  }
+  fclose(f);
+  gc_phase = GC_IDLE;
+#ifdef IBGC_THREADS
+  dropbuffers();
+#endif
+#ifdef IBGC_INCREMENTAL_SWEEP
+  sweep.p = ADDR_MASK;
+#endif
+  if (ok && h.mem_bytes < MEM_BYTES) ok = growimage(h.mem_bytes);
+  return ok ? 0 : -1;
 }
+#endif
@@ -0,0 +1,112 @@
+/*
+ * Benchmarks for the Itty-Bitty Garbage Collector
+ *
+ * Copyright (c) 2022 Robbert Haarman
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+typedef int32_t cell_t;
+typedef uint16_t addr_t;
+
+#define ADDR_MASK 0xffff
+#define CELL_SZ sizeof(cell_t)
+
+#include "ibgc.c"
+
+#define ROUNDS 20000
+
+static void reset_ibgc() {
+  freeptr = ALLOC_BASE;
+  mark_tag = 0;
+  gc_phase = GC_IDLE;
+  ibgc_init();
+}
+
+/* alloc(), but setting the tags one cell at a time. */
+static addr_t alloc_bytewise(addr_t ncells, uint8_t tag) {
+  addr_t len, p, next, prev = ADDR_MASK;
+
+  for (p = freeptr; p != ADDR_MASK; p = nextfree(p) & ADDR_MASK) {
+    len = freelen(p);
+    if (len >= ncells) break;
+    prev = p;
+  }
+  if (p == ADDR_MASK) return p;
+  takespan(prev, p, len, ncells);
+  settag(p, (tag & INFO_MASK) | (ncells > 1 ? CONT_MASK : 0) |
+         (mark_tag ^ MARK_MASK));
+  for (next = p + CELL_SZ, --ncells; ncells != 0; next += CELL_SZ, --ncells) {
+    settag(next, ncells == 1 ? 0 : CONT_MASK);
+  }
+  return p;
+}
+
+/* Returns the time in ns per allocation of ncells cells. */
+static double bench_alloc(addr_t (*allocfn)(addr_t, uint8_t), addr_t ncells) {
+  clock_t start;
+  long i;
+
+  start = clock();
+  for (i = 0; i < ROUNDS; ++i) {
+    reset_ibgc();
+    allocfn(ncells, 0);
+  }
+  return (double) (clock() - start) / CLOCKS_PER_SEC * 1e9 / ROUNDS;
+}
+
+/* Returns the time in ns to tag ncells cells as pointers, cell by cell. */
+static double bench_setptr_bytewise(addr_t ncells) {
+  clock_t start = clock();
+  addr_t i, p;
+  long j;
+
+  for (j = 0; j < ROUNDS; ++j) {
+    for (i = 0, p = ALLOC_BASE; i < ncells; ++i, p += CELL_SZ) {
+      settag(p, gettag(p) | PTR_MASK);
+    }
+  }
+  return (double) (clock() - start) / CLOCKS_PER_SEC * 1e9 / ROUNDS;
+}
+
+/* Returns the time in ns to tag ncells cells as pointers, in bulk. */
+static double bench_setptr_bulk(addr_t ncells) {
+  clock_t start = clock();
+  long j;
+
+  for (j = 0; j < ROUNDS; ++j) {
+    gc_settags(ALLOC_BASE, ncells, PTR_MASK, PTR_MASK);
+  }
+  return (double) (clock() - start) / CLOCKS_PER_SEC * 1e9 / ROUNDS;
+}
+
+int main(int argc, char *argv[]) {
+  static const addr_t sizes[] = { 2, 16, 128, 1024, 8192 };
+  double bytewise, bulk;
+  size_t i;
+
+  printf("alloc tag initialization (ns per alloc)\n");
+  printf("%8s %12s %12s %8s\n", "cells", "bytewise", "bulk", "speedup");
+  for (i = 0; i < sizeof(sizes) / sizeof(*sizes); ++i) {
+    bytewise = bench_alloc(alloc_bytewise, sizes[i]);
+    bulk = bench_alloc(alloc, sizes[i]);
+    printf("%8u %12.1f %12.1f %7.2fx\n",
+           sizes[i], bytewise, bulk, bytewise / bulk);
+  }
+
+  printf("\npointer tagging (ns per range)\n");
+  printf("%8s %12s %12s %8s\n", "cells", "bytewise", "bulk", "speedup");
+  for (i = 0; i < sizeof(sizes) / sizeof(*sizes); ++i) {
+    bytewise = bench_setptr_bytewise(sizes[i]);
+    bulk = bench_setptr_bulk(sizes[i]);
+    printf("%8u %12.1f %12.1f %7.2fx\n",
+           sizes[i], bytewise, bulk, bytewise / bulk);
+  }
+
+  return 0;
+}
@@ -0,0 +1,68 @@
+/*
+ * Tests for loading heap images (IBGC_IMAGE) of the Itty-Bitty Garbage
+ * Collector into a larger memory. Built twice: ibgc_image_test_small,
+ * with a smaller MEM_BYTES, saves an image, which ibgc_image_test
+ * loads.
+ *
+ * Copyright (c) 2022 Robbert Haarman
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include <string.h>
+
+#define IBGC_IMAGE
+#include "ibgc_test.h"
+
+/* Builds a heap with a free span at its top, and saves it. */
+static int save(const char *path) {
+  addr_t a, b, c;
+
+  reset_ibgc();
+  a = alloc(2, 0);
+  b = alloc(1, 0);
+  c = alloc(alloc_top / CELL_SZ / 2, 0);
+  alloc((alloc_top - c) / CELL_SZ - 8, 0);
+  M(b) = 42;
+  SETPTR(a, b);
+  SETPTR(a + CELL_SZ, c);
+  gc_begin();
+  gc_trace(a);
+  gc_finish();
+  return ibgc_save_image(path);
+}
+
+/* Loads the image, whose root is its first object, and uses the
+ * memory it adds. */
+static int load(const char *path) {
+  addr_t a = ALLOC_BASE, b;
+  int r = ibgc_load_image(path);
+
+  printf("load: %d\n", r);
+  if (r) return 1;
+  printf("mapped: %d\n", imagemapped);
+  printf("alloc_top: %04x\n", alloc_top);
+  show_freelist();
+  printf("cells: %04x %d %04x\n", M(a), M(M(a)), M(a + CELL_SZ));
+  printf("tags: %02x %02x %02x\n", gettag(a), gettag(a + CELL_SZ), gettag(M(a)));
+  b = alloc(0x1000, 0);
+  printf("alloc: %04x\n", b);
+  gc_begin();
+  gc_trace(a);
+  gc_finish();
+  show_freelist();
+
+  /* Changes to loaded memory, including the moved tags, must not
+   * reach the image. */
+  M(M(a)) = 43;
+  printf("load: %d\n", ibgc_load_image(path));
+  printf("cells: %04x %d tags: %02x\n", M(a), M(M(a)), gettag(a));
+  return 0;
+}
+
+int main(int argc, char *argv[]) {
+  if (argc == 3 && !strcmp(argv[1], "save")) return save(argv[2]) ? 1 : 0;
+  if (argc == 3 && !strcmp(argv[1], "load")) return load(argv[2]);
+  fprintf(stderr, "usage: %s save|load FILE\n", argv[0]);
+  return 2;
+}
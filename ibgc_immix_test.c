@@ -0,0 +1,153 @@
+/*
+ * Tests for the mark-region (IBGC_IMMIX) mode of the Itty-Bitty
+ * Garbage Collector
+ *
+ * Copyright (c) 2022 Robbert Haarman
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#define IBGC_IMMIX
+#include "ibgc_test.h"
+
+/* Prints the used lines of the blocks that are partly used. */
+static void show_lines() {
+  size_t b, n = 0;
+  char *sep = " ";
+
+  printf("lines:");
+  for (b = ALLOC_BASE / LINE_BYTES / BLOCK_LINES;
+       b < alloc_top / LINE_BYTES / BLOCK_LINES; ++b) {
+    n += popcount(lineused[b]);
+    if (lineused[b] == 0 || lineused[b] == (2UL << (BLOCK_LINES - 1)) - 1) {
+      continue;
+    }
+    printf("%s%u:%08lx", sep, (unsigned) b, lineused[b]);
+    sep = ",";
+  }
+  printf(" used: %u\n", (unsigned) n);
+}
+
+int main(int argc, char *argv[]) {
+  addr_t a, b, c, d, objs[BLOCK_LINES];
+
+  printf("bump allocation\n");
+  reset_ibgc();
+  a = alloc(2, 0);
+  b = alloc(1, 0);
+  c = alloc(3, 0);
+  printf("objects: %04x %04x %04x\n", a, b, c);
+  show_lines();
+
+  printf("\nfree lines\n");
+  gc_begin();
+  gc_trace(a);
+  gc_trace(c);
+  gc_finish();
+  show_lines();
+  d = alloc(1, 0);
+  printf("alloc: %04x\n", d);
+
+  printf("\nmedium objects\n");
+  reset_ibgc();
+  a = alloc(1, 0);
+  alloc(8, 0);
+  alloc(8, 0);
+  b = alloc(1, 0);
+  SETPTR(a, b);
+  gc_begin();
+  gc_trace(a);
+  gc_finish();
+  show_lines();
+  c = alloc(2, 0);
+  d = alloc(12, 0);
+  printf("alloc: %04x %04x %04x\n", c, d, alloc(5, 0));
+  show_lines();
+
+  printf("\nweak references\n");
+  reset_ibgc();
+  a = alloc(2, 0);
+  b = alloc(1, 0);
+  c = alloc(1, 0);
+  M(a) = b;
+  M(a + CELL_SZ) = c;
+  settag(a, gettag(a) | WEAK_MASK);
+  SETPTR(a + CELL_SZ, c);
+  gc_begin();
+  gc_trace(a);
+  gc_finish();
+  printf("cells: %04x %04x\n", M(a), M(a + CELL_SZ));
+
+  printf("\nevacuation\n");
+  reset_ibgc();
+  /* Fill the first block with one object per line, and keep every
+   * other one, so that it is not sparse but has holes. */
+  for (c = 0; c < BLOCK_LINES; ++c) objs[c] = alloc(LINE_BYTES / CELL_SZ, 0);
+  for (c = 2; c < BLOCK_LINES; c += 2) SETPTR(objs[c - 2], objs[c]);
+  a = alloc(2, 0);
+  b = alloc(1, 0);
+  d = alloc(3, 0);
+  SETPTR(a, b);
+  M(a + CELL_SZ) = d;
+  settag(a + CELL_SZ, gettag(a + CELL_SZ) | WEAK_MASK);
+  gc_add_root(&objs[0]);
+  gc_add_root(&a);
+  gc_add_root(&d);
+  printf("objects: %04x %04x %04x\n", a, b, d);
+  gc_collect();
+  printf("objects: %04x %04x %04x\n", a, M(a), d);
+  printf("cells: %04x\n", M(a + CELL_SZ));
+  show_lines();
+  gc_remove_root(&d);
+  gc_collect();
+  printf("objects: %04x %04x\n", a, M(a));
+  printf("cells: %04x\n", M(a + CELL_SZ));
+  show_lines();
+  gc_remove_root(&a);
+  gc_remove_root(&objs[0]);
+
+  printf("\nfree and resize\n");
+  reset_ibgc();
+  a = alloc(2, 0);
+  b = alloc(1, 0);
+  M(a) = 1;
+  M(a + CELL_SZ) = 2;
+  c = gc_resize(a, 4);
+  printf("resized: %04x %04x %04x\n", c, M(c), M(c + CELL_SZ));
+  gc_free(b);
+  printf("alloc: %04x\n", alloc(1, 0));
+
+  printf("\nobject crossing into an evacuated block\n");
+  reset_ibgc();
+  /* a fills the first block up to b, whose tail is all that is live
+   * in the second block, so that block is evacuated. */
+  a = alloc((BLOCK_LINES * LINE_BYTES - 2 * CELL_SZ) / CELL_SZ, 0);
+  b = alloc(4, 0);
+  for (c = 0; c < 4; ++c) M(b + c * CELL_SZ) = c + 1;
+  gc_add_root(&a);
+  gc_add_root(&b);
+  gc_collect();
+  show_lines();
+  d = alloc(2, 0);
+  M(d) = M(d + CELL_SZ) = 99;
+  printf("alloc: %04x cells: %d %d %d %d\n", d, M(b), M(b + CELL_SZ),
+         M(b + 2 * CELL_SZ), M(b + 3 * CELL_SZ));
+  gc_remove_root(&b);
+  gc_remove_root(&a);
+
+  printf("\nweak reference to an earlier object\n");
+  reset_ibgc();
+  a = alloc(1, 0);
+  b = alloc(2, 0);
+  c = alloc(1, 0);
+  M(c) = b;
+  settag(c, gettag(c) | WEAK_MASK);
+  gc_add_root(&a);
+  gc_add_root(&c);
+  gc_collect();
+  printf("cells: %04x\n", M(c));
+  gc_remove_root(&c);
+  gc_remove_root(&a);
+
+  return 0;
+}
@@ -0,0 +1,124 @@
+/*
+ * Allocation latency benchmark for the Itty-Bitty Garbage Collector,
+ * stopping the world to collect when memory runs out, or built with
+ * IBGC_TREADMILL for ibgc_treadmill_bench, or with
+ * IBGC_INCREMENTAL_SWEEP for ibgc_sweep_bench
+ *
+ * Copyright (c) 2022 Robbert Haarman
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+typedef int32_t cell_t;
+typedef uint16_t addr_t;
+
+#define ADDR_MASK 0xffff
+#define CELL_SZ sizeof(cell_t)
+
+#include "ibgc.c"
+
+#ifdef IBGC_TREADMILL
+#define MODE "treadmill"
+#define WRITE(P, V) gc_write(P, V)
+#else
+#ifdef IBGC_INCREMENTAL_SWEEP
+#define MODE "sweep"
+#else
+#define MODE "collect"
+#endif
+#define WRITE(P, V) (M(P) = (V))
+#endif
+
+/* The number of operations timed, after as many to warm up. */
+#define OPS 200000
+
+/* The number of roots, and the length at which the chain of objects
+ * hanging from a root is dropped. The live objects take about a third
+ * of the heap. */
+#define LIVE 128
+#define CHAIN 8
+
+static long times[OPS];
+
+static int cmplong(const void *a, const void *b) {
+  long x = *(const long *) a, y = *(const long *) b;
+
+  return x < y ? -1 : x > y;
+}
+
+static addr_t *roots[LIVE];
+static int len[LIVE];
+
+/* Allocates an object of 1 to 8 cells, collecting if memory is full. */
+static addr_t allocobj(long *collections) {
+  addr_t n = 1 + rand() % 8, p = alloc(n, KIND_PTRS);
+
+  if (p == ADDR_MASK) {
+    gc_collect();
+    ++*collections;
+    p = alloc(n, KIND_PTRS);
+  }
+  if (p == ADDR_MASK) {
+    fprintf(stderr, "out of memory\n");
+    exit(1);
+  }
+  return p;
+}
+
+/* Allocates an object and adds it to a random chain. */
+static void op(long *collections) {
+  int k = rand() % LIVE;
+  addr_t p = allocobj(collections);
+
+  if (len[k] < CHAIN) {
+    WRITE(p, *roots[k]);
+    ++len[k];
+  } else {
+    len[k] = 1;
+  }
+  *roots[k] = p;
+}
+
+int main(int argc, char *argv[]) {
+  struct timespec t0, t1;
+  long i, collections = 0;
+  double total = 0;
+  int k, phase;
+
+  ibgc_init();
+  for (k = 0; k < LIVE; ++k) {
+    roots[k] = gc_push_root(ADDR_MASK);
+    len[k] = 0;
+  }
+
+  srand(1);
+  for (i = 0; i < OPS; ++i) op(&collections);
+  collections = 0;
+  phase = gc_phase;
+  for (i = 0; i < OPS; ++i) {
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    op(&collections);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    times[i] = (t1.tv_sec - t0.tv_sec) * 1000000000L + t1.tv_nsec - t0.tv_nsec;
+    total += times[i];
+    /* Count the cycles alloc() finished. */
+    if (phase != GC_IDLE && gc_phase == GC_IDLE) ++collections;
+    phase = gc_phase;
+  }
+  qsort(times, OPS, sizeof(*times), cmplong);
+
+  printf("latency of alloc and store with %d live chains (ns, %d ops)\n",
+         LIVE, OPS);
+  printf("%10s %9s %9s %9s %9s %9s %12s\n", "mode", "average", "p99",
+         "p99.9", "p99.99", "maximum", "collections");
+  printf("%10s %9.1f %9ld %9ld %9ld %9ld %12ld\n", MODE, total / OPS,
+         times[OPS / 100 * 99], times[OPS / 1000 * 999],
+         times[OPS / 10000 * 9999], times[OPS - 1], collections);
+
+  return 0;
+}
@@ -0,0 +1,137 @@
+/*
+ * Tests for lock-free allocation (IBGC_LOCKFREE) in the Itty-Bitty
+ * Garbage Collector
+ *
+ * Copyright (c) 2022 Robbert Haarman
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include <pthread.h>
+
+#define IBGC_THREADS
+#define IBGC_LOCKFREE
+#include "ibgc_test.h"
+
+#define NTHREADS 4
+
+/* The number of 2-cell objects each thread allocates. */
+#define PER_THREAD 500
+
+static addr_t objs[NTHREADS][PER_THREAD];
+
+static void show_shared() {
+  printf("shared: %04x(%u) version %lu\n", SPAN_ADDR(sharedspan),
+         SPAN_CELLS(sharedspan), (unsigned long) SPAN_VERSION(sharedspan));
+}
+
+/* Allocates PER_THREAD objects, from a buffer in every other thread. */
+static void *mutator(void *arg) {
+  long k = (long) arg;
+  size_t i;
+
+  if (k % 2) gc_attach_thread();
+  for (i = 0; i < PER_THREAD; ++i) objs[k][i] = alloc(2, 0);
+  if (k % 2) gc_detach_thread();
+  return arg;
+}
+
+static int cmpaddr(const void *a, const void *b) {
+  return (int) *(const addr_t *) a - (int) *(const addr_t *) b;
+}
+
+int main(int argc, char *argv[]) {
+  pthread_t threads[NTHREADS];
+  addr_t a, b, c, *all = &objs[0][0];
+  size_t i, n, overlaps = 0;
+  long k;
+
+  printf("shared span\n");
+  reset_ibgc();
+  show_shared();
+  a = alloc(2, 0);
+  b = alloc(1, 0);
+  printf("objects: %04x %04x\n", a, b);
+  show_shared();
+  show_freelist();
+
+  printf("\nreplacing the shared span\n");
+  reset_ibgc();
+  a = alloc(4, 0);
+  alloc((alloc_top - ALLOC_BASE) / CELL_SZ - 10, 0);
+  gc_free(a);
+  show_shared();
+  show_freelist();
+  printf("alloc 8: %04x\n", alloc(8, 0));
+  show_shared();
+  show_freelist();
+  b = alloc(5, 0);
+  c = alloc(4, 0);
+  printf("alloc: %04x %04x\n", b, c);
+  show_shared();
+  show_freelist();
+
+  printf("\ncollection\n");
+  reset_ibgc();
+  a = alloc(2, 0);
+  alloc(3, 0);
+  gc_add_root(&a);
+  gc_collect();
+  show_shared();
+  show_freelist();
+  printf("alloc: %04x\n", alloc(1, 0));
+  show_shared();
+  gc_remove_root(&a);
+
+  printf("\nlocked allocation\n");
+  reset_ibgc();
+  gc_lockfree = 0;
+  a = alloc(2, 0);
+  printf("object: %04x\n", a);
+  show_shared();
+  show_freelist();
+
+  printf("\nobject after a buffer\n");
+  for (k = 0; k < 2; ++k) {
+    reset_ibgc();
+    /* Locked, then from the shared span. The buffer is carved from
+     * cells that still have the tags of a freed object. */
+    gc_lockfree = k;
+    gc_free(alloc(3 * TLAB_CELLS, 0));
+    retireall();
+    gc_attach_thread();
+    a = alloc(1, 0);
+    b = alloc(TLAB_CELLS, 0);
+    c = alloc(2, 0);
+    SETPTR(c, b);
+    gc_begin();
+    gc_trace(a);
+    gc_trace(c);
+    gc_finish();
+    printf("objects: %04x %04x %04x cells: %04x\n", a, b, c, M(c));
+    gc_detach_thread();
+  }
+
+  printf("\nconcurrent allocation\n");
+  reset_ibgc();
+  for (k = 0; k < NTHREADS; ++k) pthread_create(&threads[k], 0, mutator, (void *) k);
+  for (k = 0; k < NTHREADS; ++k) pthread_join(threads[k], 0);
+  n = NTHREADS * PER_THREAD;
+  qsort(all, n, sizeof(*all), cmpaddr);
+  for (i = 0; i < n; ++i) {
+    if (all[i] == ADDR_MASK || (i > 0 && all[i] - all[i - 1] < 2 * CELL_SZ)) {
+      ++overlaps;
+    }
+  }
+  printf("objects: %lu overlaps: %lu\n", (unsigned long) n,
+         (unsigned long) overlaps);
+  /* Where the buffers end depends on the interleaving of the threads,
+   * but the free cells add up. */
+  retireall();
+  for (n = 0, a = freeptr; a != ADDR_MASK; a = nextfree(a) & ADDR_MASK) {
+    n += freelen(a);
+  }
+  printf("free: %lu\n", (unsigned long) n);
+
+  return 0;
+}
@@ -0,0 +1,154 @@
+/*
+ * Tests for the copying nursery (IBGC_NURSERY) of the Itty-Bitty
+ * Garbage Collector
+ *
+ * Copyright (c) 2022 Robbert Haarman
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#define IBGC_NURSERY
+#define IBGC_COMPACT
+#include "ibgc_test.h"
+
+int main(int argc, char *argv[]) {
+  addr_t a, b, c, d, *r;
+
+  printf("nursery allocation\n");
+  reset_ibgc();
+  a = alloc(2, 0);
+  b = alloc(1, 0);
+  printf("objects: %04x %04x\n", a, b);
+  printf("nursery: %04x\n", nurseryptr);
+
+  printf("\nminor collection\n");
+  reset_ibgc();
+  a = alloc(2, 0);
+  b = alloc(1, 0);
+  c = alloc(1, 0);
+  d = alloc(3, 0);
+  M(b) = 42;
+  SETPTR(a, b);
+  SETPTR(a + CELL_SZ, d);
+  SETPTR(d + 2 * CELL_SZ, a);
+  r = gc_push_root(a);
+  printf("minor: %d\n", gc_minor());
+  a = *r;
+  b = M(a);
+  d = M(a + CELL_SZ);
+  printf("objects: %04x %04x %04x %04x\n", a, b, d, M(d + 2 * CELL_SZ));
+  printf("cells: %d\n", M(b));
+  printf("nursery: %04x\n", nurseryptr);
+  show_freelist();
+  printf("alloc: %04x\n", alloc(1, 0));
+  gc_pop_roots(1);
+
+  printf("\nsingle cell chain\n");
+  reset_ibgc();
+  a = alloc(1, 0);
+  b = alloc(1, 0);
+  c = alloc(1, 0);
+  SETPTR(c, b);
+  SETPTR(b, a);
+  M(a) = 7;
+  r = gc_push_root(c);
+  gc_minor();
+  c = *r;
+  printf("objects: %04x %04x %04x\n", c, M(c), M(M(c)));
+  printf("cells: %d\n", M(M(M(c))));
+  gc_pop_roots(1);
+
+  printf("\nremembered set\n");
+  reset_ibgc();
+  a = alloc(2, 0);
+  r = gc_push_root(a);
+  gc_minor();
+  a = *r;
+  b = alloc(1, 0);
+  c = alloc(1, 0);
+  M(b) = 5;
+  printf("remember: %d\n", gc_remember(a));
+  SETPTR(a, b);
+  M(a + CELL_SZ) = c;
+  settag(a + CELL_SZ, gettag(a + CELL_SZ) | WEAK_MASK);
+  printf("remember: %d %u\n", gc_remember(a), (unsigned) nremembered);
+  gc_minor();
+  printf("objects: %04x %04x %04x\n", a, M(a), M(a + CELL_SZ));
+  printf("cells: %d\n", M(M(a)));
+  printf("remembered: %u\n", (unsigned) nremembered);
+  gc_pop_roots(1);
+
+  printf("\nweak references\n");
+  reset_ibgc();
+  a = alloc(2, 0);
+  b = alloc(1, 0);
+  c = alloc(1, 0);
+  M(a) = b;
+  settag(a, gettag(a) | WEAK_MASK);
+  M(a + CELL_SZ) = c;
+  settag(a + CELL_SZ, gettag(a + CELL_SZ) | WEAK_MASK);
+  r = gc_push_root(a);
+  gc_push_root(c);
+  gc_minor();
+  a = *r;
+  printf("cells: %04x %04x %04x\n", M(a), M(a + CELL_SZ), r[1]);
+  gc_pop_roots(2);
+
+  printf("\nfull nursery\n");
+  reset_ibgc();
+  a = alloc(NURSERY_BYTES / CELL_SZ - 1, 0);
+  b = alloc(1, 0);
+  c = alloc(1, 0);
+  printf("objects: %04x %04x %04x\n", a, b, c);
+  r = gc_push_root(c);
+  printf("remember: %d\n", gc_remember(c));
+  SETPTR(c, b);
+  gc_collect();
+  c = *r;
+  printf("objects: %04x %04x\n", c, M(c));
+  printf("nursery: %04x\n", nurseryptr);
+  gc_pop_roots(1);
+
+  printf("\nfree and resize\n");
+  reset_ibgc();
+  a = alloc(2, 0);
+  M(a) = 1;
+  M(a + CELL_SZ) = 2;
+  b = gc_resize(a, 1);
+  c = alloc(1, 0);
+  printf("objects: %04x %04x\n", b, c);
+  gc_free(c);
+  printf("nursery: %04x\n", nurseryptr);
+  r = gc_push_root(b);
+  gc_minor();
+  b = *r;
+  c = gc_resize(b, 3);
+  printf("resized: %04x %04x\n", b, c);
+  gc_pop_roots(1);
+
+  printf("\ncompaction\n");
+  reset_ibgc();
+  a = alloc(2, 0);
+  b = alloc(1, 0);
+  /* a is promoted first, and freed, so that b moves down. */
+  gc_push_root(a);
+  gc_add_root(&b);
+  gc_minor();
+  gc_free(shadow_stack[0]);
+  gc_pop_roots(1);
+  c = alloc(1, 0);
+  r = gc_push_root(c);
+  SETPTR(c, b);
+  printf("remember: %d\n", gc_remember(b));
+  SETPTR(b, c);
+  printf("objects: %04x %04x\n", b, c);
+  gc_compact();
+  c = *r;
+  printf("objects: %04x %04x cells: %04x %04x\n", b, c, M(b), M(c));
+  printf("nursery: %04x\n", nurseryptr);
+  show_freelist();
+  gc_remove_root(&b);
+  gc_pop_roots(1);
+
+  return 0;
+}
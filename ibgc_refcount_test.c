@@ -0,0 +1,155 @@
+/*
+ * Tests for deferred reference counting (IBGC_REFCOUNT) in the
+ * Itty-Bitty Garbage Collector
+ *
+ * Copyright (c) 2022 Robbert Haarman
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+/* The reference counts alone take more than IMAGE_ALIGN bytes. */
+#define IMAGE_ALIGN 0x1000
+#define IBGC_REFCOUNT
+#define IBGC_COMPACT
+#define IBGC_IMAGE
+#include "ibgc_test.h"
+
+/* Prints the zero count table. */
+static void show_zct() {
+  size_t i;
+
+  printf("zct:");
+  for (i = 0; i < nzct; ++i) printf(" %04x", zct[i]);
+  printf("\n");
+}
+
+int main(int argc, char *argv[]) {
+  addr_t a, b, c, *r;
+
+  printf("zero count table\n");
+  reset_ibgc();
+  a = alloc(2, 0);
+  b = alloc(1, 0);
+  show_zct();
+  r = gc_push_root(a);
+  printf("freed: %lu\n", (unsigned long) gc_drain_zct());
+  show_zct();
+  show_freelist();
+  gc_pop_roots(1);
+
+  printf("\ncounted references\n");
+  reset_ibgc();
+  a = alloc(2, 0);
+  b = alloc(1, 0);
+  r = gc_push_root(a);
+  gc_write(a, b);
+  printf("count: %u\n", REFCOUNT(b) & RC_MAX);
+  printf("freed: %lu\n", (unsigned long) gc_drain_zct());
+  gc_write(a, ADDR_MASK);
+  printf("count: %u tag: %02x\n", REFCOUNT(b) & RC_MAX, gettag(a));
+  show_zct();
+  printf("freed: %lu\n", (unsigned long) gc_drain_zct());
+  show_freelist();
+  gc_pop_roots(1);
+
+  printf("\nfreeing a chain\n");
+  reset_ibgc();
+  a = alloc(2, 0);
+  b = alloc(2, 0);
+  c = alloc(3, KIND_PTRS);
+  r = gc_push_root(a);
+  gc_write(a, b);
+  gc_write(b + CELL_SZ, c);
+  gc_write(c + 2 * CELL_SZ, a);
+  printf("freed: %lu\n", (unsigned long) gc_drain_zct());
+  gc_write(a, ADDR_MASK);
+  printf("freed: %lu\n", (unsigned long) gc_drain_zct());
+  printf("count: %u\n", REFCOUNT(a) & RC_MAX);
+  show_zct();
+  show_freelist();
+  gc_pop_roots(1);
+
+  printf("\ncycles\n");
+  reset_ibgc();
+  a = alloc(2, 0);
+  b = alloc(1, 0);
+  c = alloc(1, 0);
+  r = gc_push_root(a);
+  gc_write(a, b);
+  gc_write(b, c);
+  gc_write(c, b);
+  gc_write(a, ADDR_MASK);
+  printf("freed: %lu\n", (unsigned long) gc_drain_zct());
+  printf("counts: %u %u\n", REFCOUNT(b) & RC_MAX, REFCOUNT(c) & RC_MAX);
+  gc_collect();
+  show_freelist();
+  gc_pop_roots(1);
+
+  printf("\nweak references\n");
+  reset_ibgc();
+  a = alloc(2, 0);
+  b = alloc(1, 0);
+  c = alloc(1, 0);
+  r = gc_push_root(a);
+  settag(a, gettag(a) | WEAK_MASK);
+  gc_write(a, b);
+  gc_write(a + CELL_SZ, c);
+  gc_write(a + CELL_SZ, ADDR_MASK);
+  printf("freed: %lu\n", (unsigned long) gc_drain_zct());
+  printf("counts: %u %u\n", REFCOUNT(b) & RC_MAX, REFCOUNT(c) & RC_MAX);
+  gc_collect();
+  printf("cell: %04x\n", M(a));
+  gc_pop_roots(1);
+
+  printf("\nrecounting\n");
+  reset_ibgc();
+  a = alloc(2, 0);
+  b = alloc(1, 0);
+  r = gc_push_root(a);
+  M(a) = b;
+  settag(a, gettag(a) | PTR_MASK);
+  gc_collect();
+  a = *r;
+  printf("count: %u\n", REFCOUNT(M(a)) & RC_MAX);
+  show_zct();
+  gc_pop_roots(1);
+
+  printf("\ncompaction\n");
+  reset_ibgc();
+  a = alloc(4, 0);
+  b = alloc(2, 0);
+  c = alloc(1, 0);
+  r = gc_push_root(b);
+  gc_write(b, c);
+  gc_free(a);
+  show_zct();
+  gc_compact();
+  b = *r;
+  c = M(b);
+  printf("objects: %04x %04x count: %u\n", b, c, REFCOUNT(c) & RC_MAX);
+  show_zct();
+  printf("freed: %lu\n", (unsigned long) gc_drain_zct());
+  show_freelist();
+  gc_pop_roots(1);
+
+  printf("\nheap image\n");
+  reset_ibgc();
+  a = alloc(2, 0);
+  b = alloc(1, 0);
+  /* Put c where its count is stored past IMAGE_ALIGN in the image. */
+  alloc((IMAGE_ALIGN * CELL_SZ - b) / CELL_SZ, 0);
+  c = alloc(1, 0);
+  r = gc_push_root(a);
+  gc_write(a, b);
+  gc_write(a + CELL_SZ, c);
+  gc_write(b, c);
+  printf("save: %d\n", ibgc_save_image("ibgc_refcount_test.img"));
+  reset_ibgc();
+  printf("load: %d\n", ibgc_load_image("ibgc_refcount_test.img"));
+  printf("object: %04x counts: %u %u\n", c, REFCOUNT(b) & RC_MAX,
+         REFCOUNT(c) & RC_MAX);
+  remove("ibgc_refcount_test.img");
+  gc_pop_roots(1);
+
+  return 0;
+}
@@ -6,44 +6,90 @@
  * SPDX-License-Identifier: MIT
  */
 
-#include <inttypes.h>
-#include <stdio.h>
-#include <stdlib.h>
+#include "ibgc_test.h"
 
-typedef int32_t cell_t;
-typedef uint16_t addr_t;
+static void show_tags(addr_t p, addr_t n) {
+  char *sep = "tags: ";
 
-#define ADDR_MASK 0xffff
-#define CELL_SZ sizeof(cell_t)
+  for (; n != 0; --n, p += CELL_SZ) {
+    printf("%s%02x", sep, gettag(p));
+    sep = " ";
+  }
+  printf("\n");
+}
+
+static void count_root(addr_t p) {
+  printf("marker got %04x\n", p);
+}
 
-#include "ibgc.c"
+#ifdef IBGC_REGIONS
+static void show_region(int r) {
+  printf("region %d: %04x %04x %04x\n", r, regions[r].base, regions[r].ptr,
+         regions[r].limit);
+}
+#endif
 
-static void show_freelist() {
-  addr_t l, n = 0, p = freeptr;
-  char *sep = "";
+#ifdef IBGC_CONSERVATIVE
+/* Addresses in this function's frame are found by scanning from
+ * gc_stack_base, which main() sets to the address of its argument. */
+NOINLINE static void test_conservative() {
+  /* volatile keeps the addresses themselves, rather than values
+   * derived from them, in the frame. */
+  volatile addr_t a, b;
 
-  for (; p < alloc_top; p = nextfree(p) & ADDR_MASK) {
-    l = freelen(p);
-    n += l;
-    printf("%s%04x(%u)", sep, p, l);
-    sep = ",";
-  }
-  printf(" total: %lu\n", (unsigned long) n);
+  printf("\nconservative stack scan\n");
+  reset_ibgc();
+  a = alloc(2, 0);
+  b = alloc(1, 0);
+  SETPTR(a, b);
+  gc_begin();
+  gc_trace_stack();
+  printf("tags: %02x %02x\n", gettag(a), gettag(b));
+  gc_finish();
 }
+#endif
 
-#define SETPTR(A, V) do {                       \
-    M(A) = (cell_t) (V);                        \
-    settag(A, gettag(A) | PTR_MASK);            \
-  } while (0)
+#ifdef IBGC_THREADS
+/* The roots of the thread started by the safepoint test, and flags for
+ * when it is ready and when it should stop. */
+static addr_t thread_roots[1];
+static size_t thread_top = 0;
+static int thread_ready = 0, thread_done = 0;
 
-void reset_ibgc() {
-  freeptr = ALLOC_BASE;
-  mark_tag = 0;
-  ibgc_init();
+/* Allocates an object that only its own roots reach, and garbage, then
+ * polls for safepoints until it is told to stop. */
+static void *safepoint_thread(void *arg) {
+  gc_attach_thread();
+  thread_roots[0] = alloc(2, 0);
+  M(thread_roots[0]) = 42;
+  alloc(3, 0);
+  thread_top = 1;
+  gc_thread_roots(thread_roots, &thread_top);
+  __atomic_store_n(&thread_ready, 1, __ATOMIC_RELEASE);
+  while (!__atomic_load_n(&thread_done, __ATOMIC_ACQUIRE)) gc_safepoint();
+  gc_detach_thread();
+  return arg;
+}
+
+/* Set once the thread that is not attached has allocated. */
+static int unattached_done = 0;
+
+static void *unattached_thread(void *arg) {
+  alloc(1, 0);
+  __atomic_store_n(&unattached_done, 1, __ATOMIC_RELEASE);
+  return arg;
 }
+#endif
 
 int main(int argc, char *argv[]) {
-  addr_t a, b, c, d;
+  addr_t a, b, c, d, roots[4], *slot;
+#ifdef IBGC_THREADS
+  struct timespec pause = { 0, 10000000 };
+  pthread_t thread;
+#endif
+#ifdef IBGC_REGIONS
+  int r, s;
+#endif
 
   printf("init\n");
   ibgc_init();
@@ -114,17 +160,18 @@ int main(int argc, char *argv[]) {
   SETPTR(c, d);
   printf("tags: %02x %02x %02x %02x %02x\n",
          gettag(a), gettag(a + CELL_SZ), gettag(b), gettag(c), gettag(d));
+  gc_begin();
   gc_trace(b);
   printf("tags: %02x %02x %02x %02x %02x\n",
          gettag(a), gettag(a + CELL_SZ), gettag(b), gettag(c), gettag(d));
   show_freelist();
-  gc_reclaim();
-  mark_tag ^= MARK_MASK;
+  gc_finish();
   show_freelist();
+  gc_begin();
   gc_trace(c);
   printf("tags: %02x %02x %02x %02x %02x\n",
          gettag(a), gettag(a + CELL_SZ), gettag(b), gettag(c), gettag(d));
-  gc_reclaim();
+  gc_finish();
   show_freelist();
 
   printf("\nreclaim coalesce both\n");
@@ -133,14 +180,533 @@ int main(int argc, char *argv[]) {
   b = alloc(1, 0);
   c = alloc(1, 0);
   SETPTR(a, b);
+  gc_begin();
   gc_trace(b);
   printf("tags: %02x %02x %02x %02x\n",
          gettag(a), gettag(a + CELL_SZ), gettag(b), gettag(c));
-  gc_reclaim();
-  mark_tag ^= MARK_MASK;
+  gc_finish();
   show_freelist();
-  gc_reclaim();
+  gc_begin();
+  gc_finish();
+  show_freelist();
+
+  printf("\nblack allocation\n");
+  reset_ibgc();
+  a = alloc(2, 0);
+  b = alloc(1, 0);
+  gc_begin();
+  gc_trace(a);
+  c = alloc(1, 0);
+  printf("tags: %02x %02x %02x %02x\n",
+         gettag(a), gettag(a + CELL_SZ), gettag(b), gettag(c));
+  gc_finish();
+  show_freelist();
+  printf("tags: %02x %02x %02x\n",
+         gettag(a), gettag(a + CELL_SZ), gettag(c));
+
+  printf("\ntrace cells after non-pointer\n");
+  reset_ibgc();
+  a = alloc(3, 0);
+  b = alloc(1, 0);
+  c = alloc(1, 0);
+  d = alloc(1, 0);
+  M(a) = 42;
+  SETPTR(a + CELL_SZ, b);
+  SETPTR(a + 2 * CELL_SZ, d);
+  SETPTR(b, c);
+  gc_begin();
+  gc_trace(a);
+  printf("cells: %d %04x %04x %04x\n",
+         M(a), M(a + CELL_SZ), M(a + 2 * CELL_SZ), M(b));
+  printf("tags: %02x %02x %02x %02x\n",
+         gettag(a), gettag(b), gettag(c), gettag(d));
+  gc_finish();
+  show_freelist();
+
+  printf("\ntrace roots\n");
+  reset_ibgc();
+  roots[0] = a = alloc(2, 0);
+  roots[1] = ADDR_MASK;
+  roots[2] = b = alloc(1, 0);
+  roots[3] = a;
+  c = alloc(1, 0);
+  d = alloc(1, 0);
+  SETPTR(a, b);
+  SETPTR(a + CELL_SZ, c);
+  gc_begin();
+  gc_trace_roots(roots, 4);
+  printf("tags: %02x %02x %02x %02x\n",
+         gettag(a), gettag(b), gettag(c), gettag(d));
+  gc_finish();
+  show_freelist();
+  gc_begin();
+  gc_marker = count_root;
+  gc_trace_roots(roots, 4);
+  gc_marker = 0;
+  gc_finish();
+
+  printf("\nfree\n");
+  reset_ibgc();
+  a = alloc(2, 0);
+  b = alloc(1, 0);
+  c = alloc(1, 0);
+  d = alloc(3, 0);
+  alloc(1, 0);
+  gc_free(b);
+  show_freelist();
+  gc_free(c);
+  show_freelist();
+  gc_free(a);
+  show_freelist();
+  a = alloc(1, 0);
+  b = alloc(2, 0);
+  SETPTR(d, b);
+  show_freelist();
+  gc_begin();
+  gc_trace(d);
+  gc_finish();
+  show_freelist();
+  gc_free(d);
+  gc_free(b);
+  show_freelist();
+
+  printf("\nalloc exact fit\n");
+  reset_ibgc();
+  a = alloc(2, 0);
+  b = alloc(1, 0);
+  M(b) = 42;
+  gc_free(a);
+  a = alloc(2, 0);
+  printf("a: %04x b: %d\n", a, M(b));
+  show_freelist();
+
+  printf("\nreclaim dead before free span\n");
+  reset_ibgc();
+  a = alloc(1, 0);
+  b = alloc(1, 0);
+  c = alloc(1, 0);
+  d = alloc(1, 0);
+  gc_free(b);
+  gc_begin();
+  gc_trace(d);
+  gc_finish();
+  show_freelist();
+
+  printf("\nresize\n");
+  reset_ibgc();
+  a = alloc(4, 0);
+  b = alloc(1, 0);
+  SETPTR(a, b);
+  M(a + CELL_SZ) = 42;
+  a = gc_resize(a, 2);
+  printf("a: %04x tags: %02x %02x\n", a, gettag(a), gettag(a + CELL_SZ));
+  show_freelist();
+  a = gc_resize(a, 3);
+  show_freelist();
+  a = gc_resize(a, 4);
+  printf("a: %04x tags: %02x %02x %02x %02x\n", a, gettag(a),
+         gettag(a + CELL_SZ), gettag(a + 2 * CELL_SZ), gettag(a + 3 * CELL_SZ));
+  show_freelist();
+  a = gc_resize(a, 6);
+  printf("a: %04x cells: %04x %d tags: %02x %02x %02x %02x %02x %02x\n",
+         a, M(a), M(a + CELL_SZ), gettag(a), gettag(a + CELL_SZ),
+         gettag(a + 2 * CELL_SZ), gettag(a + 3 * CELL_SZ),
+         gettag(a + 4 * CELL_SZ), gettag(a + 5 * CELL_SZ));
+  show_freelist();
+
+  printf("\nbulk tags\n");
+  reset_ibgc();
+  a = alloc(21, 0);
+  b = alloc(1, 0);
+  gc_settags(a + CELL_SZ, 19, PTR_MASK | INFO_MASK, PTR_MASK);
+  show_tags(a, 21);
+  gc_settags(a + 3 * CELL_SZ, 9, INFO_MASK, INFO_MASK);
+  gc_settags(a + 5 * CELL_SZ, 3, PTR_MASK, 0);
+  show_tags(a, 21);
+  for (c = 0; c < 21; ++c) M(a + c * CELL_SZ) = b;
+  gc_copy(a + 9 * CELL_SZ, a + 2 * CELL_SZ, 12);
+  show_tags(a, 21);
+  gc_copy(a + CELL_SZ, a + 11 * CELL_SZ, 10);
+  show_tags(a, 21);
+  gc_begin();
+  gc_trace(a);
+  printf("tags: %02x %02x\n", gettag(a), gettag(b));
+  gc_finish();
+
+  printf("\nobject kinds\n");
+  reset_ibgc();
+  a = alloc(3, KIND_PTRS);
+  b = alloc(2, KIND_RAW);
+  c = alloc(1, 0);
+  d = alloc(1, 0);
+  printf("cells: %04x %04x %04x\n",
+         M(a), M(a + CELL_SZ), M(a + 2 * CELL_SZ));
+  show_tags(a, 3);
+  show_tags(b, 2);
+  M(a + CELL_SZ) = b;
+  M(b) = c;
+  M(b + CELL_SZ) = d;
+  settag(b, gettag(b) | PTR_MASK);
+  gc_begin();
+  gc_trace(a);
+  printf("tags: %02x %02x %02x %02x\n",
+         gettag(a), gettag(b), gettag(c), gettag(d));
+  printf("cells: %04x %04x %04x\n",
+         M(a), M(a + CELL_SZ), M(a + 2 * CELL_SZ));
+  gc_finish();
+  show_freelist();
+  a = gc_resize(a, 5);
+  show_tags(a, 5);
+  printf("cells: %04x %04x %04x %04x %04x\n",
+         M(a), M(a + CELL_SZ), M(a + 2 * CELL_SZ), M(a + 3 * CELL_SZ),
+         M(a + 4 * CELL_SZ));
+
+  printf("\nregistered roots\n");
+  reset_ibgc();
+  slot = gc_push_root(alloc(2, 0));
+  b = alloc(1, 0);
+  gc_push_root(alloc(1, 0));
+  d = alloc(1, 0);
+  c = alloc(1, 0);
+  SETPTR(*slot, b);
+  gc_add_root(&c);
+  gc_add_root(&d);
+  gc_collect();
   show_freelist();
+  gc_pop_roots(1);
+  gc_remove_root(&c);
+  gc_collect();
+  show_freelist();
+  *slot = ADDR_MASK;
+  gc_remove_root(&d);
+  gc_collect();
+  show_freelist();
+  gc_pop_roots(1);
+
+  printf("\nweak references\n");
+  reset_ibgc();
+  a = alloc(3, 0);
+  b = alloc(1, 0);
+  c = alloc(1, 0);
+  d = alloc(2, 0);
+  M(a) = b;
+  M(a + CELL_SZ) = c;
+  M(a + 2 * CELL_SZ) = ADDR_MASK;
+  gc_settags(a, 3, WEAK_MASK, WEAK_MASK);
+  SETPTR(d, c);
+  M(d + CELL_SZ) = b;
+  settag(d + CELL_SZ, gettag(d + CELL_SZ) | WEAK_MASK);
+  gc_add_root(&a);
+  gc_add_root(&d);
+  gc_collect();
+  printf("cells: %04x %04x %04x %04x\n",
+         M(a), M(a + CELL_SZ), M(a + 2 * CELL_SZ), M(d + CELL_SZ));
+  show_freelist();
+  gc_remove_root(&d);
+  gc_collect();
+  printf("cells: %04x %04x %04x\n", M(a), M(a + CELL_SZ), M(a + 2 * CELL_SZ));
+  show_freelist();
+  gc_remove_root(&a);
+
+  printf("\nfinalization\n");
+  reset_ibgc();
+  a = alloc(2, 0);
+  b = alloc(1, 0);
+  c = alloc(1, 0);
+  d = alloc(1, 0);
+  SETPTR(a, b);
+  gc_register_finalizer(a);
+  gc_register_finalizer(b);
+  gc_register_finalizer(c);
+  gc_add_root(&c);
+  gc_collect();
+  printf("queued: %u\n", (unsigned) nqueued);
+  show_freelist();
+  printf("drained: %u", (unsigned) gc_drain_finalizers(roots, 1));
+  printf(" %04x\n", roots[0]);
+  printf("drained: %u", (unsigned) gc_drain_finalizers(roots, 4));
+  printf(" %04x\n", roots[0]);
+  gc_collect();
+  show_freelist();
+  gc_remove_root(&c);
+  gc_collect();
+  printf("queued: %u\n", (unsigned) nqueued);
+  gc_drain_finalizers(roots, 4);
+  gc_collect();
+  show_freelist();
+
+  printf("\nephemerons\n");
+  reset_ibgc();
+  a = alloc(EPHEMERON_CELLS, KIND_EPHEMERON);
+  b = alloc(EPHEMERON_CELLS, KIND_EPHEMERON);
+  c = alloc(1, 0);
+  d = alloc(2, 0);
+  roots[0] = alloc(1, 0);
+  roots[1] = alloc(1, 0);
+  /* a maps c to d, b maps d (reachable only through a) to roots[1],
+   * and d points back at c. */
+  M(a) = c;
+  M(a + CELL_SZ) = d;
+  M(b) = d;
+  M(b + CELL_SZ) = roots[1];
+  SETPTR(d, c);
+  printf("cells: %04x %04x %04x\n", M(a), M(a + CELL_SZ), M(a + 2 * CELL_SZ));
+  gc_begin();
+  gc_trace(b);
+  gc_trace(a);
+  gc_trace(c);
+  gc_finish();
+  printf("cells: %04x %04x %04x %04x\n", M(a), M(a + CELL_SZ), M(b), M(b + CELL_SZ));
+  show_freelist();
+  gc_begin();
+  gc_trace(a);
+  gc_trace(b);
+  gc_finish();
+  printf("cells: %04x %04x %04x %04x\n", M(a), M(a + CELL_SZ), M(b), M(b + CELL_SZ));
+  show_freelist();
+
+#ifdef IBGC_INTERIOR
+  printf("\ninterior pointers\n");
+  reset_ibgc();
+  a = alloc(4, 0);
+  b = alloc(3, 0);
+  c = alloc(2, 0);
+  roots[0] = alloc(1, 0);
+  d = alloc(1, 0);
+  M(a) = 1;
+  SETPTR(a + CELL_SZ, b + 2 * CELL_SZ);
+  M(a + 2 * CELL_SZ) = 3;
+  SETPTR(a + 3 * CELL_SZ, c + CELL_SZ);
+  SETPTR(b, a + 3 * CELL_SZ);
+  M(b + CELL_SZ) = 5;
+  SETPTR(b + 2 * CELL_SZ, c);
+  SETPTR(c, d);
+  M(c + CELL_SZ) = 7;
+  printf("starts: %04x %04x %04x %04x\n", objstart(a + 3 * CELL_SZ),
+         objstart(b + CELL_SZ), objstart(c + CELL_SZ), objstart(d));
+  gc_begin();
+  gc_trace(a + 2 * CELL_SZ);
+  printf("tags: %02x %02x %02x %02x %02x\n",
+         gettag(a), gettag(b), gettag(c), gettag(roots[0]), gettag(d));
+  printf("cells: %d %04x %d %04x %04x %d %04x %04x %d\n",
+         M(a), M(a + CELL_SZ), M(a + 2 * CELL_SZ), M(a + 3 * CELL_SZ),
+         M(b), M(b + CELL_SZ), M(b + 2 * CELL_SZ), M(c), M(c + CELL_SZ));
+  for (c = ALLOC_BASE; c < alloc_top && !(gettag(c) & SCRATCH_MASK);
+       c += CELL_SZ);
+  printf("scratch bits left: %s\n", c < alloc_top ? "yes" : "no");
+  gc_finish();
+  show_freelist();
+  printf("starts: %04x %04x\n", objstart(roots[0]), objstart(d + CELL_SZ));
+#endif
+
+#ifdef IBGC_COMPACT
+  printf("\ncompaction\n");
+  reset_ibgc();
+  a = alloc(2, 0);
+  alloc(3000, 0);
+  b = alloc(1, 0);
+  alloc(3000, 0);
+  d = alloc(2, 0);
+  c = alloc(4, KIND_PTRS);
+  SETPTR(a, b);
+  M(a + CELL_SZ) = d;
+  settag(a + CELL_SZ, gettag(a + CELL_SZ) | WEAK_MASK);
+  M(c + 2 * CELL_SZ) = b;
+  gc_add_root(&a);
+  slot = gc_push_root(c);
+  gc_collect();
+  printf("fragmentation: %u\n", gc_fragmentation());
+  printf("objects: %04x %04x\n", a, *slot);
+  show_freelist();
+  printf("cells: %04x %04x %04x\n", M(a), M(a + CELL_SZ), M(*slot + 2 * CELL_SZ));
+  gc_collect();
+  printf("fragmentation: %u\n", gc_fragmentation());
+  gc_pop_roots(1);
+  gc_remove_root(&a);
+#endif
+
+#ifdef IBGC_THREADS
+  printf("\nallocation buffers\n");
+  reset_ibgc();
+  a = alloc(2, 0);
+  printf("attach: %d\n", gc_attach_thread());
+  b = alloc(3, 0);
+  c = alloc(TLAB_CELLS - 3, 0);
+  d = alloc(1, 0);
+  printf("objects: %04x %04x %04x %04x\n", a, b, c, d);
+  show_freelist();
+  printf("buffer: %04x %04x\n", tlab->ptr, tlab->limit);
+  alloc(TLAB_CELLS, 0);
+  printf("buffer: %04x %04x\n", tlab->ptr, tlab->limit);
+  gc_begin();
+  gc_trace(b);
+  gc_trace(d);
+  gc_finish();
+  show_freelist();
+  printf("buffer: %04x %04x\n", tlab->ptr, tlab->limit);
+  printf("alloc: %04x\n", alloc(1, 0));
+  gc_detach_thread();
+  show_freelist();
+
+  printf("\nsafepoints\n");
+  reset_ibgc();
+  pthread_create(&thread, 0, safepoint_thread, 0);
+  while (!__atomic_load_n(&thread_ready, __ATOMIC_ACQUIRE));
+  show_freelist();
+  gc_collect();
+  printf("object: %04x %d\n", thread_roots[0], M(thread_roots[0]));
+  show_freelist();
+  __atomic_store_n(&thread_done, 1, __ATOMIC_RELEASE);
+  pthread_join(thread, 0);
+  show_freelist();
+
+  printf("\nalloc from a thread that is not attached\n");
+  reset_ibgc();
+  gc_stop_world();
+  pthread_create(&thread, 0, unattached_thread, 0);
+  nanosleep(&pause, 0);
+  printf("allocated: %d\n",
+         __atomic_load_n(&unattached_done, __ATOMIC_ACQUIRE));
+  gc_start_world();
+  pthread_join(thread, 0);
+  printf("allocated: %d\n", unattached_done);
+  show_freelist();
+#endif
+
+#ifdef IBGC_IMAGE
+  printf("\nheap image\n");
+  reset_ibgc();
+  a = alloc(2, 0);
+  b = alloc(1, 0);
+  alloc(3, 0);
+  M(b) = 42;
+  SETPTR(a, b);
+  gc_begin();
+  gc_trace(a);
+  gc_finish();
+  printf("save: %d\n", ibgc_save_image("ibgc_test.img"));
+  reset_ibgc();
+  alloc(5, 0);
+  printf("load: %d\n", ibgc_load_image("ibgc_test.img"));
+  printf("mapped: %d\n", imagemapped);
+  show_freelist();
+  printf("cells: %04x %d\n", M(a), M(M(a)));
+  show_tags(a, 3);
+  printf("alloc: %04x\n", alloc(1, 0));
+  /* Changes to loaded memory must not reach the image. */
+  M(M(a)) = 43;
+  printf("load: %d\n", ibgc_load_image("ibgc_test.img"));
+  printf("cells: %04x %d\n", M(a), M(M(a)));
+  remove("ibgc_test.img");
+  printf("load: %d\n", ibgc_load_image("ibgc_test.img"));
+#endif
+
+#ifdef IBGC_REGIONS
+  printf("\nopening a region\n");
+  reset_ibgc();
+  a = alloc(2, 0);
+  r = gc_region_open(16);
+  b = alloc(1, 0);
+  show_region(r);
+  show_freelist();
+
+  printf("\nallocation\n");
+  c = gc_region_alloc(r, 3, KIND_PTRS);
+  d = gc_region_alloc(r, 2, INFO_MASK);
+  printf("objects: %04x %04x tags: %02x %02x\n", c, d, gettag(c), gettag(d));
+  show_region(r);
+  printf("too large: %04x\n", gc_region_alloc(r, 12, 0));
+  printf("last: %04x\n", gc_region_alloc(r, 11, 0));
+  show_region(r);
+  printf("full: %04x\n", gc_region_alloc(r, 1, 0));
+
+  printf("\ncollection\n");
+  reset_ibgc();
+  r = gc_region_open(8);
+  a = gc_region_alloc(r, 2, 0);
+  b = alloc(1, 0);
+  c = alloc(1, 0);
+  SETPTR(a, b);
+  gc_collect();
+  show_region(r);
+  show_freelist();
+  gc_free(a);
+  show_freelist();
+
+  printf("\nrelease\n");
+  reset_ibgc();
+  a = alloc(2, 0);
+  r = gc_region_open(8);
+  s = gc_region_open(4);
+  b = alloc(1, 0);
+  gc_region_alloc(r, 3, 0);
+  gc_region_alloc(s, 4, 0);
+  gc_free(a);
+  show_freelist();
+  printf("released: %d\n", gc_region_release(r));
+  show_freelist();
+  printf("released: %d\n", gc_region_release(s));
+  show_freelist();
+  printf("reopened: %d\n", gc_region_open(4));
+
+#ifdef IBGC_REGION_CHECK
+  printf("\nescaping references\n");
+  reset_ibgc();
+  r = gc_region_open(8);
+  a = gc_region_alloc(r, 2, 0);
+  b = gc_region_alloc(r, 1, 0);
+  c = alloc(2, 0);
+  SETPTR(a, b);
+  SETPTR(c + CELL_SZ, b);
+  gc_push_root(a);
+  printf("escapes: %lu\n", (unsigned long) gc_region_escapes(r));
+  printf("released: %d\n", gc_region_release(r));
+  gc_pop_roots(1);
+  settag(c + CELL_SZ, gettag(c + CELL_SZ) & ~PTR_MASK);
+  printf("escapes: %lu\n", (unsigned long) gc_region_escapes(r));
+  settag(c + CELL_SZ, gettag(c + CELL_SZ) | WEAK_MASK);
+  printf("escapes: %lu\n", (unsigned long) gc_region_escapes(r));
+  M(c + CELL_SZ) = ADDR_MASK;
+  printf("released: %d\n", gc_region_release(r));
+  show_freelist();
+#endif
+
+  printf("\nresizing\n");
+  reset_ibgc();
+  r = gc_region_open(8);
+  a = gc_region_alloc(r, 4, 0);
+  b = gc_region_alloc(r, 1, 0);
+  c = gc_resize(a, 2);
+  printf("shrunk: %04x tag: %02x\n", c, gettag(a + 2 * CELL_SZ));
+  c = gc_resize(b, 2);
+  printf("grown: %04x\n", c);
+  gc_collect();
+  show_region(r);
+  show_freelist();
+
+#ifdef IBGC_COMPACT
+  printf("\ncompaction\n");
+  reset_ibgc();
+  a = alloc(4, 0);
+  r = gc_region_open(6);
+  b = gc_region_alloc(r, 2, 0);
+  c = alloc(1, 0);
+  SETPTR(b, c);
+  gc_free(a);
+  gc_compact();
+  show_region(r);
+  printf("objects: %04x %04x\n", regions[r].base, M(regions[r].base));
+  show_freelist();
+  printf("released: %d\n", gc_region_release(r));
+  show_freelist();
+#endif
+#endif
+
+#ifdef IBGC_CONSERVATIVE
+  gc_stack_base = &argc;
+  test_conservative();
+  gc_stack_base = 0;
+#endif
 
   return 0;
 }
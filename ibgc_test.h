@@ -0,0 +1,52 @@
+/*
+ * Shared fixture for the tests of the Itty-Bitty Garbage Collector
+ *
+ * Copyright (c) 2022 Robbert Haarman
+ *
+ * SPDX-License-Identifier: MIT
+ *
+ * Define the IBGC_ options and sizes a test needs, then include this
+ * file instead of ibgc.c.
+ */
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+typedef int32_t cell_t;
+typedef uint16_t addr_t;
+
+#define ADDR_MASK 0xffff
+#define CELL_SZ sizeof(cell_t)
+
+#include "ibgc.c"
+
+#define SETPTR(A, V) do {                       \
+    M(A) = (cell_t) (V);                        \
+    settag(A, gettag(A) | PTR_MASK);            \
+  } while (0)
+
+#if !defined(IBGC_IMMIX) && !defined(IBGC_TREADMILL)
+static void show_freelist() {
+  addr_t l, n = 0, p = freeptr;
+  char *sep = "";
+
+  for (; p < alloc_top; p = nextfree(p) & ADDR_MASK) {
+    l = freelen(p);
+    n += l;
+    printf("%s%04x(%u)", sep, p, l);
+    sep = ",";
+  }
+  printf(" total: %lu\n", (unsigned long) n);
+}
+#endif
+
+/* Starts over with an empty heap. */
+static void reset_ibgc() {
+#if !defined(IBGC_IMMIX) && !defined(IBGC_TREADMILL)
+  freeptr = ALLOC_BASE;
+#endif
+  mark_tag = 0;
+  gc_phase = GC_IDLE;
+  ibgc_init();
+}
@@ -0,0 +1,168 @@
+/*
+ * Multi-threaded allocation benchmarks for the Itty-Bitty Garbage
+ * Collector, built with IBGC_THREADS and IBGC_LOCKFREE
+ *
+ * Copyright (c) 2022 Robbert Haarman
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include <inttypes.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+typedef int32_t cell_t;
+typedef uint16_t addr_t;
+
+#define ADDR_MASK 0xffff
+#define CELL_SZ sizeof(cell_t)
+
+#define IBGC_THREADS
+#define IBGC_LOCKFREE
+#include "ibgc.c"
+
+#define ROUNDS 2000
+
+/* The number of 2-cell objects allocated per round, by all threads
+ * together. They fill most of the heap. */
+#define OBJECTS 4096
+
+/* The number of collections for which the time to safepoint is
+ * measured, and the number of objects each thread allocates between
+ * them. */
+#define COLLECTIONS 100
+#define BETWEEN 64
+
+static pthread_barrier_t start, done;
+static int nthreads, attach, stop;
+static long allocated;
+
+static void reset_ibgc() {
+  freeptr = ALLOC_BASE;
+  mark_tag = 0;
+  gc_phase = GC_IDLE;
+  ibgc_init();
+}
+
+/* Allocates this thread's share of the objects in every round. */
+static void *mutator(void *arg) {
+  long i, j;
+
+  if (attach) gc_attach_thread();
+  for (i = 0; i < ROUNDS; ++i) {
+    pthread_barrier_wait(&start);
+    for (j = 0; j < OBJECTS / nthreads; ++j) alloc(2, 0);
+    pthread_barrier_wait(&done);
+  }
+  if (attach) gc_detach_thread();
+  return arg;
+}
+
+/* Returns the wall clock time in ns per allocation with n threads,
+ * which allocate from buffers if usetlab is set, and otherwise from
+ * the shared span if lockfree is set, or under heap_lock. */
+static double bench_threads(int n, int usetlab, int lockfree) {
+  pthread_t threads[MAX_THREADS];
+  struct timespec t0, t1;
+  double ns = 0;
+  long i;
+  int k;
+
+  nthreads = n;
+  attach = usetlab;
+  gc_lockfree = lockfree;
+  pthread_barrier_init(&start, 0, n + 1);
+  pthread_barrier_init(&done, 0, n + 1);
+  for (k = 0; k < n; ++k) pthread_create(&threads[k], 0, mutator, 0);
+  for (i = 0; i < ROUNDS; ++i) {
+    reset_ibgc();
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    pthread_barrier_wait(&start);
+    pthread_barrier_wait(&done);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    ns += (t1.tv_sec - t0.tv_sec) * 1e9 + (t1.tv_nsec - t0.tv_nsec);
+  }
+  for (k = 0; k < n; ++k) pthread_join(threads[k], 0);
+  pthread_barrier_destroy(&start);
+  pthread_barrier_destroy(&done);
+  gc_lockfree = 1;
+  return ns / ROUNDS / (OBJECTS / n * n);
+}
+
+/* Allocates and polls for safepoints until told to stop, keeping the
+ * last object as a root. */
+static void *poller(void *arg) {
+  addr_t roots[1] = { ADDR_MASK };
+  size_t top = 1;
+
+  gc_attach_thread();
+  gc_thread_roots(roots, &top);
+  pthread_barrier_wait(&start);
+  while (!__atomic_load_n(&stop, __ATOMIC_ACQUIRE)) {
+    roots[0] = alloc(2, 0);
+    __atomic_fetch_add(&allocated, 1, __ATOMIC_RELAXED);
+    gc_safepoint();
+  }
+  gc_detach_thread();
+  return arg;
+}
+
+/* Collects while n threads allocate, and returns the average time to
+ * safepoint in us. The maximum is left in gc_safepoint_max_ns. */
+static double bench_safepoints(int n) {
+  pthread_t threads[MAX_THREADS];
+  double ns = 0;
+  long i;
+  int k;
+
+  reset_ibgc();
+  gc_safepoint_max_ns = 0;
+  stop = 0;
+  pthread_barrier_init(&start, 0, n + 1);
+  for (k = 0; k < n; ++k) pthread_create(&threads[k], 0, poller, 0);
+  pthread_barrier_wait(&start);
+  for (i = 0; i < COLLECTIONS; ++i) {
+    /* Let the threads get going again first. */
+    __atomic_store_n(&allocated, 0, __ATOMIC_RELAXED);
+    while (__atomic_load_n(&allocated, __ATOMIC_RELAXED) < BETWEEN * n) {
+      sched_yield();
+    }
+    gc_collect();
+    ns += gc_safepoint_ns;
+  }
+  __atomic_store_n(&stop, 1, __ATOMIC_RELEASE);
+  for (k = 0; k < n; ++k) pthread_join(threads[k], 0);
+  pthread_barrier_destroy(&start);
+  return ns / COLLECTIONS / 1000;
+}
+
+int main(int argc, char *argv[]) {
+  static const int counts[] = { 1, 2, 4, 8 };
+  double locked, shared, buffered;
+  size_t i;
+
+  printf("concurrent alloc of 2 cells (ns per alloc, wall clock)\n");
+  printf("%8s %12s %12s %12s %13s %13s\n", "threads", "locked",
+         "lock-free", "tlab", "lf speedup", "tlab speedup");
+  for (i = 0; i < sizeof(counts) / sizeof(*counts); ++i) {
+    locked = bench_threads(counts[i], 0, 0);
+    shared = bench_threads(counts[i], 0, 1);
+    buffered = bench_threads(counts[i], 1, 1);
+    printf("%8d %12.1f %12.1f %12.1f %12.2fx %12.2fx\n", counts[i],
+           locked, shared, buffered, locked / shared, locked / buffered);
+  }
+
+  printf("\ntime to safepoint while allocating (us, %d collections)\n",
+         COLLECTIONS);
+  printf("%8s %12s %12s\n", "threads", "average", "maximum");
+  for (i = 0; i < sizeof(counts) / sizeof(*counts); ++i) {
+    shared = bench_safepoints(counts[i]);
+    printf("%8d %12.1f %12.1f\n",
+           counts[i], shared, gc_safepoint_max_ns / 1000.0);
+  }
+
+  return 0;
+}
@@ -0,0 +1,147 @@
+/*
+ * Tests for the treadmill (IBGC_TREADMILL) mode of the Itty-Bitty
+ * Garbage Collector
+ *
+ * Copyright (c) 2022 Robbert Haarman
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+/* Only four pages, so that cycles start as soon as a class runs low. */
+#define MEM_BYTES 0x2000
+#define TREADMILL_QUANTUM 4
+#define IBGC_TREADMILL
+#include "ibgc_test.h"
+
+static const char *colour(addr_t p) {
+  if (isfree(p)) return "white";
+  if (gettag(p) & SCRATCH_MASK) return "gray";
+  return "black";
+}
+
+static size_t listlen(addr_t list) {
+  addr_t p;
+  size_t n = 0;
+
+  for (p = TM_NEXT(list); p != list; p = TM_NEXT(p)) ++n;
+  return n;
+}
+
+/* Prints the lengths of the lists of class c. */
+static void show_class(unsigned c) {
+  printf("class %u: free %lu white %lu black %lu weak %lu\n", c,
+         (unsigned long) listlen(TM_LIST(c, TM_FREE)),
+         (unsigned long) listlen(TM_LIST(c, TM_WHITE)),
+         (unsigned long) listlen(TM_LIST(c, TM_BLACK)),
+         (unsigned long) listlen(TM_LIST(c, TM_WEAKBLACK)));
+}
+
+int main(int argc, char *argv[]) {
+  addr_t a, b, c, d, x;
+  size_t i, n;
+  int phase;
+
+  printf("size classes\n");
+  reset_ibgc();
+  a = alloc(1, 0);
+  b = alloc(3, 0);
+  c = alloc(4, 0);
+  d = alloc(128, 0);
+  printf("objects: %04x %04x %04x %04x\n", a, b, c, d);
+  printf("classes: %u %u %u %u\n", slotclass(a), slotclass(b), slotclass(c),
+         slotclass(d));
+  printf("too large: %04x\n", alloc(129, 0));
+  printf("next page: %04x\n", nextpage);
+  show_class(2);
+
+  printf("\nincremental collection\n");
+  reset_ibgc();
+  a = ADDR_MASK;
+  gc_add_root(&a);
+  for (i = 0; i < 10; ++i) {
+    b = alloc(2, 0);
+    M(b) = i;
+    gc_write(b + CELL_SZ, a);
+    a = b;
+  }
+  /* Allocate garbage until a cycle has started and finished, and the
+   * next one has started. */
+  phase = gc_phase;
+  for (i = n = 0; n < 3; ++i) {
+    alloc(1, 0);
+    if (gc_phase == phase) continue;
+    phase = gc_phase;
+    printf("allocation %lu: %s\n", (unsigned long) i,
+           phase == GC_IDLE ? "finished" : "started");
+    if (phase == GC_IDLE) {
+      show_class(0);
+      show_class(1);
+    }
+    ++n;
+  }
+  for (n = 0, b = a; b != ADDR_MASK; b = M(b + CELL_SZ)) ++n;
+  printf("list: %lu\n", (unsigned long) n);
+  gc_remove_root(&a);
+
+  printf("\nwrite barrier\n");
+  reset_ibgc();
+  x = alloc(2, KIND_PTRS);
+  a = alloc(1, KIND_PTRS);
+  b = alloc(1, 0);
+  gc_write(x, a);
+  gc_write(a, b);
+  gc_add_root(&x);
+  gc_step(0);
+  printf("colours: %s %s %s\n", colour(x), colour(a), colour(b));
+  gc_step(2);
+  printf("colours: %s %s %s\n", colour(x), colour(a), colour(b));
+  gc_write(a, ADDR_MASK);
+  printf("colours: %s %s %s\n", colour(x), colour(a), colour(b));
+  gc_write(x + CELL_SZ, b);
+  gc_write(x, ADDR_MASK);
+  while (gc_step(1));
+  printf("cells: %04x %04x\n", M(x), M(x + CELL_SZ));
+  show_class(0);
+  show_class(1);
+  gc_collect();
+  show_class(0);
+  gc_remove_root(&x);
+
+  printf("\nweak references\n");
+  reset_ibgc();
+  x = alloc(2, 0);
+  a = alloc(1, 0);
+  b = alloc(1, 0);
+  settag(x, gettag(x) | WEAK_MASK);
+  gc_write(x, a);
+  gc_write(x + CELL_SZ, b);
+  gc_add_root(&x);
+  gc_collect();
+  printf("cells: %04x %04x\n", M(x), M(x + CELL_SZ));
+  c = alloc(1, 0);
+  gc_step(0);
+  gc_step(2);
+  printf("colours: %s %s %s\n", colour(x), colour(b), colour(c));
+  gc_write(x, c);
+  show_class(1);
+  while (gc_step(1));
+  printf("cells: %04x %04x\n", M(x), M(x + CELL_SZ));
+  gc_remove_root(&x);
+
+  printf("\nfree and resize\n");
+  reset_ibgc();
+  a = alloc(3, 0);
+  b = alloc(3, 0);
+  gc_free(a);
+  show_class(2);
+  M(b) = 1;
+  M(b + CELL_SZ) = 2;
+  printf("resized: %04x\n", gc_resize(b, 4));
+  printf("resized: %04x\n", gc_resize(b, 2));
+  c = gc_resize(b, 5);
+  printf("resized: %04x %04x %04x\n", c, M(c), M(c + CELL_SZ));
+  show_class(2);
+  show_class(3);
+
+  return 0;
+}